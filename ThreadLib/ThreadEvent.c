@@ -0,0 +1,267 @@
+/* See the file Distribution for distribution terms. */
+
+/*	ThreadEvent lets threads other than the main thread handle events. The
+	main thread still gets every event, but rather than handling an event
+	for a window that belongs to another thread it hands the event to that
+	thread, which is woken up to handle it. Events for a thread are kept in
+	a queue of its own, so during a burst of events (a drag, or a series of
+	updates) the main thread can route several of them before the thread
+	runs, and the thread then handles them all in one go. */
+
+/*----------------------------------------------------------------------------*/
+/* include statements */
+/*----------------------------------------------------------------------------*/
+
+#include <string.h>
+#include <Events.h>
+#include <Windows.h>
+#include "ThreadLib.h"
+#include "ThreadEvent.h"
+
+/*----------------------------------------------------------------------------*/
+/* declarations */
+/*----------------------------------------------------------------------------*/
+
+/* Define THREAD_EVENT_ROUTES as the largest number of routes, and
+	THREAD_EVENT_THREADS as the largest number of threads that events can be
+	routed to. Each of those threads has a queue of THREAD_EVENT_QUEUE
+	events. */
+#ifndef THREAD_EVENT_ROUTES
+	#define THREAD_EVENT_ROUTES	(16)
+#endif
+#ifndef THREAD_EVENT_THREADS
+	#define THREAD_EVENT_THREADS	(8)
+#endif
+#ifndef THREAD_EVENT_QUEUE
+	#define THREAD_EVENT_QUEUE		(16)
+#endif
+
+/* queue of events routed to a thread */
+typedef struct {
+	ThreadType thread;							/* thread events are routed to */
+	short head;										/* oldest event in queue */
+	short count;									/* number of events in queue */
+	EventRecord event[THREAD_EVENT_QUEUE];	/* the events */
+} EventQueueType, *EventQueuePtr;
+
+/* a route sends events for a window, or events accepted by a filter, to
+	a thread's queue */
+typedef struct {
+	WindowPtr window;								/* window, or NULL */
+	ThreadEventFilterType filter;				/* filter, or NULL */
+	void *data;										/* parameter passed to filter */
+	EventQueuePtr queue;							/* queue of thread; NULL if unused */
+} EventRouteType, *EventRoutePtr;
+
+/* state of event routing */
+static struct {
+	EventRouteType route[THREAD_EVENT_ROUTES];
+	EventQueueType queue[THREAD_EVENT_THREADS];
+} gEvent;
+
+/* EventQueueFor returns the queue for the thread, giving it an unused queue
+	if it doesn't have one yet. Returns NULL if every queue is in use. */
+static EventQueuePtr EventQueueFor(ThreadType thread)
+{
+	EventQueuePtr queue;
+	EventQueuePtr unused;
+	short i;
+	
+	queue = unused = NULL;
+	for (i = 0; i < THREAD_EVENT_THREADS && ! queue; i++) {
+		if (gEvent.queue[i].thread == thread)
+			queue = &gEvent.queue[i];
+		else if (gEvent.queue[i].thread == THREAD_NONE && ! unused)
+			unused = &gEvent.queue[i];
+	}
+	if (! queue && unused) {
+		queue = unused;
+		queue->thread = thread;
+		queue->head = queue->count = 0;
+	}
+	return(queue);
+}
+
+/* EventRouteAdd adds a route to the thread's queue. Returns noErr, or
+	memFullErr if there's no room for the route or the queue. */
+static OSErr EventRouteAdd(WindowPtr window, ThreadEventFilterType filter,
+	void *data, ThreadType thread)
+{
+	EventRoutePtr route;
+	EventQueuePtr queue;
+	short i;
+	
+	route = NULL;
+	for (i = 0; i < THREAD_EVENT_ROUTES && ! route; i++) {
+		if (! gEvent.route[i].queue)
+			route = &gEvent.route[i];
+	}
+	queue = (route ? EventQueueFor(thread) : NULL);
+	if (queue) {
+		route->window = window;
+		route->filter = filter;
+		route->data = data;
+		route->queue = queue;
+	}
+	return(queue ? noErr : memFullErr);
+}
+
+/* EventWindow returns the window an event is for, or NULL if it isn't
+	for any window the application should handle in the ordinary way.
+	Mouse-downs outside a window's content, drag, grow or close regions,
+	and keys pressed with the command key (menu shortcuts), are left to
+	the main thread. */
+static WindowPtr EventWindow(const EventRecord *event)
+{
+	WindowPtr window;
+	short part;
+	
+	window = NULL;
+	switch (event->what) {
+		case mouseDown:
+			part = FindWindow(event->where, &window);
+			if (part != inContent && part != inDrag && part != inGrow && part != inGoAway)
+				window = NULL;
+			break;
+		case mouseUp:
+			window = FrontWindow();
+			break;
+		case keyDown:
+		case keyUp:
+		case autoKey:
+			if (! (event->modifiers & cmdKey))
+				window = FrontWindow();
+			break;
+		case updateEvt:
+		case activateEvt:
+			window = (WindowPtr) event->message;
+			break;
+	}
+	return(window);
+}
+
+/* EventQueued returns true if the same update event is already in the
+	queue; the Event Manager keeps returning an update event until the
+	window is updated, so it's only queued once. */
+static Boolean EventQueued(EventQueuePtr queue, const EventRecord *event)
+{
+	Boolean queued;
+	short i;
+	
+	queued = false;
+	if (event->what == updateEvt) {
+		for (i = 0; i < queue->count && ! queued; i++) {
+			const EventRecord *e = &queue->event[(queue->head + i) % THREAD_EVENT_QUEUE];
+			queued = (e->what == updateEvt && e->message == event->message);
+		}
+	}
+	return(queued);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Routing Events */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadEventRouteWindow routes events for the window to the thread.
+	Returns noErr, or memFullErr if there are already THREAD_EVENT_ROUTES
+	routes or THREAD_EVENT_THREADS threads receiving events. */
+OSErr ThreadEventRouteWindow(WindowPtr window, ThreadType thread)
+{
+	return(EventRouteAdd(window, NULL, NULL, thread));
+}
+
+/*	�ThreadEventRouteFilter routes each event for which 'filter' returns true
+	to the thread. Filters are only consulted for events that aren't routed
+	by window, in the order in which they were added. Returns noErr or
+	memFullErr, as for ThreadEventRouteWindow. */
+OSErr ThreadEventRouteFilter(ThreadEventFilterType filter, void *data,
+	ThreadType thread)
+{
+	return(EventRouteAdd(NULL, filter, data, thread));
+}
+
+/*	�ThreadEventUnroute removes every route to the thread and discards any
+	events waiting in its queue. A thread must do this before it ends, or
+	before it disposes of a window routed to it. */
+void ThreadEventUnroute(ThreadType thread)
+{
+	short i;
+	
+	for (i = 0; i < THREAD_EVENT_ROUTES; i++) {
+		if (gEvent.route[i].queue && gEvent.route[i].queue->thread == thread)
+			memset(&gEvent.route[i], 0, sizeof(gEvent.route[i]));
+	}
+	for (i = 0; i < THREAD_EVENT_THREADS; i++) {
+		if (gEvent.queue[i].thread == thread)
+			gEvent.queue[i].thread = THREAD_NONE;
+	}
+}
+
+/*	�ThreadEventRoute is called by the main thread for each event it gets.
+	If the event is routed to a thread it's added to the thread's queue and
+	the thread is woken up, but the main thread carries on, so that it can
+	route any more events before the thread runs. Returns true if the event
+	was routed, or false if the main thread should handle the event
+	itself, which it must also do if the thread's queue is full. */
+Boolean ThreadEventRoute(const EventRecord *event)
+{
+	EventRoutePtr route;
+	EventQueuePtr queue;
+	WindowPtr window;
+	short i;
+	
+	route = NULL;
+	window = EventWindow(event);
+	if (window) {
+		for (i = 0; i < THREAD_EVENT_ROUTES && ! route; i++) {
+			if (gEvent.route[i].queue && gEvent.route[i].window == window)
+				route = &gEvent.route[i];
+		}
+	}
+	for (i = 0; i < THREAD_EVENT_ROUTES && ! route; i++) {
+		if (gEvent.route[i].queue && gEvent.route[i].filter &&
+			 gEvent.route[i].filter(event, gEvent.route[i].data))
+		{
+			route = &gEvent.route[i];
+		}
+	}
+	queue = (route ? route->queue : NULL);
+	if (queue && ! EventQueued(queue, event)) {
+		if (queue->count == THREAD_EVENT_QUEUE)
+			queue = NULL;
+		else {
+			queue->event[(queue->head + queue->count) % THREAD_EVENT_QUEUE] = *event;
+			queue->count++;
+			ThreadSleepSet(queue->thread, 0);
+		}
+	}
+	return(queue != NULL);
+}
+
+/*	�ThreadEventGet removes the oldest event from the active thread's queue
+	and returns true, or returns false if there are no events waiting. */
+Boolean ThreadEventGet(EventRecord *event)
+{
+	EventQueuePtr queue;
+	short i;
+	
+	queue = NULL;
+	for (i = 0; i < THREAD_EVENT_THREADS && ! queue; i++) {
+		if (gEvent.queue[i].thread == ThreadActive() && gEvent.queue[i].count)
+			queue = &gEvent.queue[i];
+	}
+	if (queue) {
+		*event = queue->event[queue->head];
+		queue->head = (queue->head + 1) % THREAD_EVENT_QUEUE;
+		queue->count--;
+	}
+	return(queue != NULL);
+}
+
+/*	�ThreadEventWait returns the oldest event in the active thread's queue,
+	sleeping until an event is routed to the thread if there are none. */
+void ThreadEventWait(EventRecord *event)
+{
+	while (! ThreadEventGet(event))
+		ThreadYield(THREAD_TICKS_MAX);
+}
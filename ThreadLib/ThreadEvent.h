@@ -0,0 +1,19 @@
+/* See the file Distribution for distribution terms. */
+
+#pragma once
+
+#include <Events.h>
+#include <Windows.h>
+#include "ThreadLib.h"
+
+/* function deciding whether an event is routed to a thread; it's passed
+	the 'data' given to ThreadEventRouteFilter */
+typedef Boolean (*ThreadEventFilterType)(const EventRecord *event, void *data);
+
+OSErr ThreadEventRouteWindow(WindowPtr window, ThreadType thread);
+OSErr ThreadEventRouteFilter(ThreadEventFilterType filter, void *data,
+	ThreadType thread);
+void ThreadEventUnroute(ThreadType thread);
+Boolean ThreadEventRoute(const EventRecord *event);
+Boolean ThreadEventGet(EventRecord *event);
+void ThreadEventWait(EventRecord *event);
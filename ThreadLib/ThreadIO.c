@@ -0,0 +1,129 @@
+/* See the file Distribution for distribution terms. */
+
+/*	ThreadIO makes asynchronous File Manager calls on behalf of a thread.
+	The calling thread sleeps until the call completes, while other threads,
+	including the main thread, continue to run; a synchronous call would
+	stop every thread for as long as the disk is busy. */
+
+/*----------------------------------------------------------------------------*/
+/* include statements */
+/*----------------------------------------------------------------------------*/
+
+#include <Files.h>
+#include "ThreadLib.h"
+#include "ThreadIO.h"
+
+/*----------------------------------------------------------------------------*/
+/* completion routine */
+/*----------------------------------------------------------------------------*/
+
+/* Define THREAD_IO_COMPLETION as 1 to wake a thread from a completion routine
+	when its call completes, or as 0 to have the thread poll the result of the
+	call each time it's scheduled. The completion routine is passed the
+	parameter block in register a0, so it's only available with GCC on the
+	68k, where a few instructions of assembly language can pass it on to a
+	C function. */
+#ifndef THREAD_IO_COMPLETION
+	#if defined(__GNUC__) && defined(__m68k__)
+		#define THREAD_IO_COMPLETION (1)
+	#else
+		#define THREAD_IO_COMPLETION (0)
+	#endif
+#endif
+
+#if THREAD_IO_COMPLETION
+
+/* ThreadIODone is called at interrupt time, by way of ThreadIOCompletion,
+	when a call completes. It posts the record's wakeup for the thread that
+	made the call (see ThreadPost) and marks the call as done; the wakeup
+	is posted first so that ThreadIOWait can tell when it's safe to return.
+	Since globals are absolute with GCC, register a5 needn't be set up. */
+void ThreadIODone(ThreadIOPtr io);
+void ThreadIODone(ThreadIOPtr io)
+{
+	ThreadPost(&io->post);
+	io->done = true;
+}
+
+/* ThreadIOCompletion is the completion routine for every call. The File
+	Manager passes it the parameter block, which is also the ThreadIORec,
+	in register a0; registers d0-d2 and a0-a1 needn't be preserved. */
+void ThreadIOCompletion(void);
+
+asm(
+	"	.text\n"
+	"	.even\n"
+	"	.globl	ThreadIOCompletion\n"
+	"ThreadIOCompletion:\n"
+	"	move.l	%a0,-(%sp)\n"
+	"	jsr		ThreadIODone\n"
+	"	addq.l	#4,%sp\n"
+	"	rts\n"
+);
+
+#endif /* THREAD_IO_COMPLETION */
+
+/*----------------------------------------------------------------------------*/
+/*	�Asynchronous I/O */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadIOStart prepares the record for an asynchronous call made by the
+	active thread. Call it after filling in the parameter block and just
+	before passing the parameter block to any asynchronous File Manager
+	routine (such as PBGetCatInfoAsync), then call ThreadIOWait. Any
+	completion routine in the parameter block is replaced. */
+void ThreadIOStart(ThreadIOPtr io)
+{
+	io->done = false;
+	io->post.posted = false;
+	io->post.thread = ThreadActive();
+	io->post.proc = NULL;
+	io->post.data = NULL;
+	#if THREAD_IO_COMPLETION
+		io->pb.ioParam.ioCompletion = NewIOCompletionUPP((IOCompletionProcPtr) ThreadIOCompletion);
+	#else
+		io->pb.ioParam.ioCompletion = NULL;
+	#endif
+}
+
+/*	�ThreadIOWait suspends the active thread until the call started with
+	ThreadIOStart completes, and returns the call's result. Other threads
+	run in the meantime. The thread sleeps until the completion routine
+	wakes it up, so it takes no processor time while it waits. If it's the
+	main thread that's waiting, it's still activated whenever no other
+	thread needs to run or an event is pending, but it must not handle
+	events until the call has completed. */
+OSErr ThreadIOWait(ThreadIOPtr io)
+{
+	#if THREAD_IO_COMPLETION
+		while (! io->done)
+			ThreadYield(THREAD_TICKS_MAX);
+		/* the wakeup must have been handled before the record can be reused */
+		while (io->post.posted)
+			ThreadYield(0);
+	#else
+		while (io->pb.ioParam.ioResult > 0)
+			ThreadYield(0);
+	#endif
+	return(io->pb.ioParam.ioResult);
+}
+
+/*	�ThreadIORead reads from a file with PBReadAsync, suspending the active
+	thread until the read completes. The parameter block is set up just as
+	for PBRead. Returns the result of the read. */
+OSErr ThreadIORead(ThreadIOPtr io)
+{
+	ThreadIOStart(io);
+	(void) PBReadAsync(&io->pb);
+	return(ThreadIOWait(io));
+}
+
+/*	�ThreadIOWrite writes to a file with PBWriteAsync, suspending the active
+	thread until the write completes. The parameter block is set up just as
+	for PBWrite. Returns the result of the write. */
+OSErr ThreadIOWrite(ThreadIOPtr io)
+{
+	ThreadIOStart(io);
+	(void) PBWriteAsync(&io->pb);
+	return(ThreadIOWait(io));
+}
@@ -0,0 +1,24 @@
+/* See the file Distribution for distribution terms. */
+
+#pragma once
+
+#include <Files.h>
+#include "ThreadLib.h"
+
+/* An asynchronous File Manager call made through ThreadIO. The parameter
+	block is filled in by the caller just as for the File Manager, except
+	for the ioCompletion field, which is set by ThreadIOStart. The record
+	must remain valid until the call has completed, so it mustn't be a
+	local variable of a thread created with THREAD_OPTION_COPY_STACK (whose
+	stack is copied elsewhere while it's suspended); the same applies to
+	the buffer passed to a read or write. */
+typedef struct {
+	ParamBlockRec pb;								/* parameter block for the call */
+	ThreadPostRec post;							/* wakes thread when call completes */
+	volatile Boolean done;						/* true once call has completed */
+} ThreadIORec, *ThreadIOPtr;
+
+void ThreadIOStart(ThreadIOPtr io);
+OSErr ThreadIOWait(ThreadIOPtr io);
+OSErr ThreadIORead(ThreadIOPtr io);
+OSErr ThreadIOWrite(ThreadIOPtr io);
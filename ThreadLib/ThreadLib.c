@@ -78,9 +78,14 @@
 /*----------------------------------------------------------------------------*/
 
 #include <setjmp.h>
+#include <string.h>
 #include <Events.h>
+#include <Gestalt.h>
 #include <Memory.h>
 #include <OSUtils.h>
+#include <Processes.h>
+#include <Timer.h>
+#include <Windows.h>
 #include "ThreadLib.h"
 
 /*----------------------------------------------------------------------------*/
@@ -145,17 +150,170 @@
     /* Offsets derived from moveml/movel instructions in setjmp: */
     /* a7 (sp) is saved at byte offset 8. */
     /* a6 is the 11th register in moveml d2-d7/a2-a6, saved at byte offset 60. */
+    /* The return address is saved at byte offset 12. */
     #define JMP_BUF_A6_INDEX 15 /* Index for a6 = 60 / sizeof(int) */
     #define JMP_BUF_A7_INDEX 2  /* Index for a7 = 8 / sizeof(int)  */
+    #define JMP_BUF_PC_INDEX 3  /* Index for pc = 12 / sizeof(int) */
 #endif
 
+/* values returned by calls to setjmp */
+typedef enum { THREAD_SAVE, THREAD_RUN };
+
+/* Functions that switch stacks, or that must have a stack frame of their
+	own, are declared THREAD_NOINLINE so that an optimizing compiler can't
+	merge them into their callers. */
+#if defined(__GNUC__)
+	#define THREAD_NOINLINE __attribute__((noinline))
+#else
+	#define THREAD_NOINLINE
+#endif
+
+/*	Notes on optimization with GCC: Thread Library is safe to compile with
+	-O2 or -Os. No local variables are live across a call to setjmp, since
+	every context switch goes through a call to ThreadContextSwitch, after
+	which the compiler assumes nothing about the registers it doesn't
+	preserve and reloads any global variables it needs. Deferring the
+	popping of arguments (the GCC equivalent of THINK C's "defer and combine
+	stack adjusts") is harmless for the same reason: a thread always resumes
+	with exactly the stack pointer it had when it called ThreadContextSwitch.
+	Low-memory globals changed by interrupts, such as Ticks, are read
+	through volatile pointers so that loops see them change. The one thing
+	that does matter is register a6: ThreadStackFrame and my automatic
+	segment unloading routines follow the chain of frame pointers, so if
+	they're used the application should be compiled with
+	-fno-omit-frame-pointer, which the optimized targets in the Makefile
+	do. */
+
+/* Define THREAD_ASM_SWITCH as 1 to switch contexts with the hand-written
+	routines below, or as 0 to switch contexts with setjmp and longjmp.
+	The routines are used by default when compiling with GCC for the 68k. */
+#ifndef THREAD_ASM_SWITCH
+	#if defined(__GNUC__) && defined(__m68k__)
+		#define THREAD_ASM_SWITCH (1)
+	#else
+		#define THREAD_ASM_SWITCH (0)
+	#endif
+#endif
+
+#if THREAD_ASM_SWITCH
+
+	/* A thread's context holds only the registers that a C function must
+		preserve, d2-d7 and a2-a7, and the address at which to resume. Since
+		a context switch is always done by calling ThreadContextSwitch, the
+		compiler has already saved any other registers it needs. The fields
+		are in the order used by movem, so the context is saved with a single
+		movem and restored with another. */
+	typedef struct {
+		long pc;							/* address to resume at */
+		long d[6];						/* registers d2-d7 */
+		long a[6];						/* registers a2-a7 */
+	} ThreadContextType;
+	
+	#define ThreadContextA6(context)	((context)->a[4])
+	#define ThreadContextSP(context)	((context)->a[5])
+	
+	/* ThreadContextSwitch saves the current context in 'save' and resumes
+		the context in 'restore'. It returns when the saved context is later
+		resumed. ThreadContextLoad resumes a context without saving the
+		current one, and ThreadContextGet saves the current context without
+		switching. All three pop the return address before saving, so the
+		saved stack pointer is the stack pointer after the return address
+		has been popped, and the resume address is the return address;
+		resuming any saved context looks like a normal return to the
+		caller. ThreadContextGet returns by jumping to the return address
+		for the same reason. */
+	void ThreadContextSwitch(ThreadContextType *save, ThreadContextType *restore);
+	void ThreadContextLoad(ThreadContextType *restore);
+	void ThreadContextGet(ThreadContextType *context);
+	
+	asm(
+		"	.text\n"
+		"	.even\n"
+		"	.globl	ThreadContextSwitch\n"
+		"ThreadContextSwitch:\n"
+		"	move.l	(%sp)+,%d0\n"
+		"	move.l	(%sp),%a0\n"
+		"	move.l	4(%sp),%a1\n"
+		"	movem.l	%d0/%d2-%d7/%a2-%a7,(%a0)\n"
+		"ThreadContextResume:\n"
+		"	movem.l	(%a1),%d0/%d2-%d7/%a2-%a7\n"
+		"	move.l	%d0,%a0\n"
+		"	jmp	(%a0)\n"
+		"	.globl	ThreadContextLoad\n"
+		"ThreadContextLoad:\n"
+		"	move.l	4(%sp),%a1\n"
+		"	bra.s	ThreadContextResume\n"
+		"	.globl	ThreadContextGet\n"
+		"ThreadContextGet:\n"
+		"	move.l	(%sp)+,%d0\n"
+		"	move.l	(%sp),%a0\n"
+		"	movem.l	%d0/%d2-%d7/%a2-%a7,(%a0)\n"
+		"	move.l	%d0,%a0\n"
+		"	jmp	(%a0)\n"
+	);
+	
+	/* ThreadContextStart sets up a context so that when it's resumed 'start'
+		is called on the stack whose top is at 'top', as though from a
+		function at the base of the stack. Register a6 is cleared so that
+		tracing function calls on the stack stops there. */
+	static void ThreadContextStart(ThreadContextType *context, Ptr top,
+		void (*start)(void))
+	{
+		memset(context, 0, sizeof(ThreadContextType));
+		context->pc = (long) start;
+		ThreadContextSP(context) = (long) top - sizeof(long);
+		ThreadContextA6(context) = 0;
+	}
+	
+#else /* THREAD_ASM_SWITCH */
+
+	/* Without the hand-written routines a thread's context is a jmp_buf,
+		which must be wrapped in a structure so it can be passed around. */
+	typedef struct {
+		jmp_buf env;					/* registers saved by setjmp */
+	} ThreadContextType;
+	
+	// #define ThreadContextA6(context)	((context)->env[a6])
+	#define ThreadContextA6(context)	((context)->env[JMP_BUF_A6_INDEX])
+	// #define ThreadContextSP(context)	((context)->env[a7])
+	#define ThreadContextSP(context)	((context)->env[JMP_BUF_A7_INDEX])
+	
+	#define ThreadContextLoad(context)	longjmp((context)->env, THREAD_RUN)
+	#define ThreadContextGet(context)	((void) setjmp((context)->env))
+	
+	static THREAD_NOINLINE void ThreadContextSwitch(ThreadContextType *save,
+		ThreadContextType *restore)
+	{
+		if (setjmp(save->env) == THREAD_SAVE)
+			longjmp(restore->env, THREAD_RUN);
+	}
+	
+	/* Since longjmp returns by storing the saved return address on the
+		saved stack and executing rts, the stack pointer is set one long-word
+		lower than for the hand-written routines. */
+	static void ThreadContextStart(ThreadContextType *context, Ptr top,
+		void (*start)(void))
+	{
+		(void) setjmp(context->env);
+		context->env[JMP_BUF_PC_INDEX] = (long) start;
+		ThreadContextSP(context) = (long) top - 2 * sizeof(long);
+		ThreadContextA6(context) = 0;
+	}
+	
+#endif /* THREAD_ASM_SWITCH */
+
 /*----------------------------------------------------------------------------*/
 /* debug declarations */
 /*----------------------------------------------------------------------------*/
 
 /* Define THREAD_DEBUG as 1 to enable debug code, or 0 to disable debug code.
 	You can also define NDEBUG to disable debug code. Debug code is enabled
-	by default if both THREAD_DEBUG and NDEBUG are undefined. */
+	by default if both THREAD_DEBUG and NDEBUG are undefined. At level 1,
+	ThreadValid only checks the markers at either end of a thread structure,
+	which is cheap enough for the assertions on every context switch. Define
+	THREAD_DEBUG as 2 to also check the size of each thread's block in the
+	heap and the consistency of the thread queue, which calls the Memory
+	Manager and is much slower. */
 #ifndef THREAD_DEBUG
 	#ifndef NDEBUG
 		#define THREAD_DEBUG			(1)
@@ -190,8 +348,11 @@
 	files may be used. */
 #ifndef __LOMEM__
 	#include <sysequ.h>
-	#define LMGetTicks()				(*(long *) Ticks)
-	#define LMGetEventQueue()		((QHdrPtr) EventQueue)
+	#define LMGetTicks()				(*(volatile long *) Ticks)
+	#define LMGetEventQueue()		((volatile QHdr *) EventQueue)
+	#define LMGetWindowList()		(*(WindowPeek *) WindowList)
+	#define LMGetCurActivate()		(*(WindowPtr *) CurActivate)
+	#define LMGetCurDeactive()		(*(WindowPtr *) CurDeactive)
 	#define LMGetHeapEnd()			(*(Ptr *) HeapEnd)
 	#define LMGetHiHeapMark()		(*(Ptr *) HiHeapMark)
 	#define LMGetApplLimit()		(*(Ptr *) ApplLimit)
@@ -207,6 +368,9 @@
 	Ptr StkLowPt : 0x0110;
 	#define LMGetTicks()				(Ticks)
 	#define LMGetEventQueue()		(&EventQueue)
+	#define LMGetWindowList()		(WindowList)
+	#define LMGetCurActivate()		(CurActivate)
+	#define LMGetCurDeactive()		(CurDeactive)
 	#define LMGetHeapEnd()			(HeapEnd)
 	#define LMGetHiHeapMark()		(HiHeapMark)
 	#define LMGetApplLimit()		(ApplLimit)
@@ -279,15 +443,65 @@
 /* global variable and type definitions */
 /*----------------------------------------------------------------------------*/
 
-/* values returned by calls to setjmp */
-typedef enum { THREAD_SAVE, THREAD_RUN };
+/* number of size classes in a thread's arena (see ThreadAlloc) */
+#define ARENA_CLASSES				(6)
+
+/* Define THREAD_STATS as 0 to leave out the counters kept for each thread
+	(see ThreadStats), or define THREAD_STATS_TIME as 0 to keep the counters
+	but not measure how long threads run, which saves a call to Microseconds
+	on every context switch. */
+#ifndef THREAD_STATS
+	#define THREAD_STATS (1)
+#endif
+#ifndef THREAD_STATS_TIME
+	#define THREAD_STATS_TIME (THREAD_STATS)
+#endif
+
+/* Define THREAD_KEYS as the number of thread-local storage keys that can
+	be allocated at once (see ThreadKeyNew); every thread has a slot for
+	each key. */
+#ifndef THREAD_KEYS
+	#define THREAD_KEYS (8)
+#endif
+
+/* values of the markers at either end of a valid thread structure */
+#define THREAD_MAGIC					('THRD')
+#define THREAD_CANARY				('thrd')
+
+/* The structures and stacks of a batch of threads created together share
+	one block, which starts with this header and is disposed of once every
+	thread in the batch has been (see ThreadBeginBatch). */
+typedef struct {
+	short live;							/* threads not yet disposed of */
+	Handle handle;						/* temporary memory holding block, or NULL */
+} BatchHeaderType, *BatchHeaderPtr;
+
+/* BatchAlign rounds a size in a batch's block up to a multiple of 4 */
+#define BatchAlign(size)			(((size) + 3) & ~3L)
 
 /* structure describing a thread */
 typedef struct ThreadStructure {
+	long magic;							/* THREAD_MAGIC if structure is in use */
 	struct ThreadStructure *next;	/* next thread in queue */
 	struct ThreadStructure *prev;	/* previous thread in queue */
 	Ptr stack;							/* thread's stack */
-	jmp_buf jmpenv;					/* cpu's state for context switch */
+	size_t stack_size;				/* size of thread's stack */
+	ThreadOptionsType options;		/* options passed to ThreadBeginOptions */
+	Ptr saved;							/* copy of frames taken off shared stack */
+	size_t saved_size;				/* number of bytes used in 'saved' */
+	size_t saved_capacity;			/* number of bytes allocated for 'saved' */
+	size_t stack_peak;				/* most frames saved for copy-stack thread */
+	Ptr arena;							/* thread's arena for ThreadAlloc */
+	size_t arena_size;				/* size of thread's arena */
+	Ptr arena_next;					/* next unused byte in arena */
+	void *arena_free[ARENA_CLASSES]; /* free blocks in each size class */
+	Handle stack_handle;				/* temporary memory holding stack, or NULL */
+	BatchHeaderPtr batch;			/* block shared with batch, or NULL */
+	Ptr fpu_state;						/* saved FPU context, if thread uses FPU */
+	short sched_class;				/* class of thread (see ThreadClassSet) */
+	short credit;						/* turns owed to thread (see ThreadTurn) */
+	struct SchedulerStructure *scheduler; /* scheduler the thread belongs to */
+	ThreadContextType context;		/* cpu's state for context switch */
 	ThreadType sn;						/* thread's serial number */
 	ThreadTicksType wake;			/* when to wake thread */
 	ThreadProcType entry;			/* thread's entry point */
@@ -295,10 +509,13 @@ typedef struct ThreadStructure {
 	ThreadProcType resume;			/* called when thread is resumed */
 	ThreadStatusType status;		/* status of thread */
 	void *data;							/* data to pass to thread's call-backs */
+	void *key[THREAD_KEYS];			/* thread-local storage (see ThreadKeyNew) */
+	ThreadStatsType stats;			/* counters (see ThreadStats) */
 	Ptr heapEnd;						/* value of HeapEnd low-memory global */
 	Ptr applLimit;						/* value of ApplLimit low-memory global */
 	Ptr hiHeapMark;					/* value of HiHeapMark low-memory global */
 	ThreadExceptionType exception;/* saved state of exception handler */
+	long canary;						/* THREAD_CANARY if not overwritten */
 } ThreadStructure, *ThreadPtr;
 
 /* queue of threads */
@@ -308,6 +525,54 @@ typedef struct {
 	short nelem;						/* number of elements in queue */
 } ThreadQueueType, *ThreadQueuePtr;
 
+/* A scheduler is a group of threads that are only scheduled among
+	themselves (see ThreadSchedulerRun). The default scheduler, which the
+	main thread belongs to, is the root of the tree of schedulers. All
+	threads stay in the one queue of threads, so that they can still be
+	found by serial number. */
+typedef struct SchedulerStructure {
+	struct SchedulerStructure *parent; /* scheduler running this one, or NULL */
+	ThreadPtr owner;					/* thread running this scheduler, or NULL */
+	ThreadTicksType deadline;		/* when owner gets control back */
+	short weight[THREAD_CLASSES];	/* turns for each class of thread */
+	ThreadSchedulerStatsType stats;/* counters */
+} SchedulerStructure, *SchedulerPtr;
+
+/* number of different entry points for which stack sizes are recommended */
+#define STACK_TABLE_SIZE			(16)
+
+/* ticks to wait before retrying to activate a thread whose stack or
+	copy-stack buffer couldn't be allocated */
+#define STACK_RETRY_INTERVAL		(15)
+
+/* stack usage recorded for an entry point (see ThreadStackRecommended) */
+typedef struct {
+	ThreadProcType entry;			/* entry point of threads */
+	size_t peak;						/* most stack used by any of the threads */
+} StackTableType;
+
+/* A block in the reserved region is preceded by its size, which includes
+	the size field itself; a free block also links to the next free block. */
+typedef struct RegionBlockType {
+	size_t size;						/* size of block */
+	struct RegionBlockType *next;	/* next free block */
+} RegionBlockType, *RegionBlockPtr;
+
+/* Define THREAD_MAIN_CALLS as the number of calls that can be waiting for
+	the main thread at once (see ThreadMainCall). */
+#ifndef THREAD_MAIN_CALLS
+	#define THREAD_MAIN_CALLS (16)
+#endif
+
+/* call to be made by the main thread */
+typedef struct MainCallType {
+	struct MainCallType *next;		/* next call in queue or free list */
+	ThreadProcType proc;				/* function to call */
+	void *data;							/* parameter to pass to function */
+	ThreadType caller;				/* thread waiting for call, or THREAD_NONE */
+	Boolean done;						/* true once call has been made */
+} MainCallType, *MainCallPtr;
+
 /* structure describing state of thread library */
 typedef struct {
 	OSErr error;						/* error code from last function called */
@@ -316,26 +581,124 @@ typedef struct {
 	ThreadPtr main;					/* main thread */
 	ThreadPtr active;					/* currently active thread */
 	ThreadPtr dispose;				/* thread to dispose of */
+	size_t arena_default;			/* arena size for new threads */
+	Boolean temp_memory;				/* true if temporary memory can be used */
+	size_t reserve;					/* size of reserved region to allocate */
+	Ptr region;							/* reserved region */
+	size_t region_size;				/* size of reserved region */
+	RegionBlockPtr region_free;	/* free blocks in reserved region, by address */
+	Boolean fpu;						/* true if there's a floating point unit */
+	ThreadPtr fpu_owner;				/* thread whose context is in the FPU */
+	GrowZoneUPP grow_prev;			/* grow-zone function we replaced */
+	long recovered;					/* bytes released by grow-zone function */
+	Ptr shared;							/* stack shared by copy-stack threads */
+	size_t shared_size;				/* size of shared stack */
+	ThreadPtr shared_owner;			/* thread whose frames are on shared stack */
+	Ptr copier_stack;					/* private stack used to copy frames */
+	ThreadContextType copier;		/* context that copies frames */
+	StackTableType stack_table[STACK_TABLE_SIZE]; /* stack use by entry point */
+	TMTask preempt_task;				/* Time Manager task requesting preemption */
+	long preempt_quantum;			/* milliseconds between requests, or 0 */
+	QHdr post;							/* records posted by ThreadPost */
+	long event_checks;				/* calls to EventAvail by scheduler */
+	ThreadStatsType stats;			/* counters for all threads together */
+	UnsignedWide stats_start;		/* when active thread was last activated */
+	Boolean process_mgr;				/* true if the Process Manager is available */
+	Boolean wake_process;			/* true if 'process' can be woken up */
+	ProcessSerialNumber process;	/* application's process (see ThreadPost) */
+	short background;					/* 1 if application is in background, else 0 */
+	ThreadProfileType profile[2];	/* foreground and background profiles */
+	Boolean headless;					/* true if scheduler ignores events */
+	short busy;							/* nonzero inside ThreadCallBack */
+	SchedulerStructure root;		/* default scheduler */
+	SchedulerPtr scheduler;			/* scheduler now running */
+	Boolean key_used[THREAD_KEYS];	/* true for each allocated key */
+	ThreadProcType key_destructor[THREAD_KEYS]; /* called for key's values */
+	MainCallPtr call_head;			/* first call waiting for main thread */
+	MainCallPtr call_tail;			/* last call waiting for main thread */
+	MainCallPtr call_free;			/* unused call records */
+	MainCallType call_pool[THREAD_MAIN_CALLS]; /* call records */
 } ThreadStateType;
 
 /* state of thread library */
 static ThreadStateType gThread;
 
+/* set at interrupt time when the active thread should be preempted */
+volatile Boolean gThreadPreemptRequest;
+
+/* ThreadCallBack calls one of the application's functions from inside
+	Thread Library, such as a thread's suspend or resume function, where
+	the library may be half way through a context switch. The active
+	thread isn't preempted until the function returns (see ThreadCheck). */
+#define ThreadCallBack(proc, data) \
+	((void) (gThread.busy++, (proc)(data), gThread.busy--))
+
+/* Define THREAD_STATIC_THREADS as the largest number of threads, including
+	the main thread, that will ever exist at once to have thread structures
+	and stacks allocated from tables of fixed size instead of from the heap.
+	Each thread other than the main thread then has a stack (and arena) of
+	THREAD_STATIC_STACK bytes. Creating a thread doesn't allocate any memory,
+	except for the buffers of copy-stack threads. */
+#ifndef THREAD_STATIC_THREADS
+	#define THREAD_STATIC_THREADS (0)
+#endif
+#ifndef THREAD_STATIC_STACK
+	#define THREAD_STATIC_STACK (8192L)
+#endif
+
+#if THREAD_STATIC_THREADS
+
+	#if THREAD_STATIC_THREADS < 2
+		#error "THREAD_STATIC_THREADS must allow for the main thread and at least one other"
+	#endif
+
+	/* The main thread always uses the first entry in the table of threads.
+		Since it uses the application's stack, there's one fewer stack than
+		there are threads. */
+	static ThreadStructure gThreadTable[THREAD_STATIC_THREADS];
+	static long gThreadStacks[THREAD_STATIC_THREADS - 1][THREAD_STATIC_STACK / sizeof(long)];
+	
+	/* index of a thread in the table of threads */
+	#define ThreadIndex(thread)	((thread) - gThreadTable)
+
+#endif /* THREAD_STATIC_THREADS */
+
+/* ThreadStackPending is true if the thread was created with
+	THREAD_OPTION_LAZY_STACK and its stack has not been allocated yet. */
+#define ThreadStackPending(thread) \
+	(((thread)->options & THREAD_OPTION_LAZY_STACK) && ! (thread)->stack)
+
+/* RegionContains is true if the pointer is in the reserved region */
+#define RegionContains(p) \
+	(gThread.region && gThread.region <= (Ptr) (p) && \
+	 (Ptr) (p) < gThread.region + gThread.region_size)
+
+/* RegionSize returns the usable size of a block in the reserved region */
+#define RegionSize(p)	(((size_t *) (p))[-1] - sizeof(size_t))
+
 /*----------------------------------------------------------------------------*/
 /*	Thread Validation */
 /*----------------------------------------------------------------------------*/
 
-#if THREAD_DEBUG
+#if THREAD_DEBUG >= 2
 
-/*	ThreadValid returns true if the 'thread' parameter is a valid thread.
-	This function is primarily for use during debugging, and is called
-	by the preconditions to most of the functions in Thread Library. You
-	will usually not need to call this function. So that this function can
-	easily be called from within other thread functions, the error code is not
-	set by this function. */
-static Boolean ThreadValid(ThreadPtr thread)
+/* ThreadValidFull returns true if the thread structure is the right size
+	and its fields are consistent with each other. */
+static Boolean ThreadValidFull(ThreadPtr thread)
 {
-	if (! thread || GetPtrSize((Ptr) thread) != sizeof(ThreadStructure)) return(false);
+	#if THREAD_STATIC_THREADS
+		if (thread < gThreadTable || gThreadTable + THREAD_STATIC_THREADS <= thread)
+			return(false);
+		if (((Ptr) thread - (Ptr) gThreadTable) % sizeof(ThreadStructure)) return(false);
+	#else
+		if (thread->batch) {
+			if (thread->batch->live <= 0) return(false);
+		}
+		else if (RegionContains(thread)) {
+			if (RegionSize(thread) < sizeof(ThreadStructure)) return(false);
+		}
+		else if (GetPtrSize((Ptr) thread) != sizeof(ThreadStructure)) return(false);
+	#endif
 	if (thread->sn <= 0 || gThread.lastsn < thread->sn) return(false);
 	if (gThread.main) {
 		if (thread == gThread.main) {
@@ -343,13 +706,35 @@ static Boolean ThreadValid(ThreadPtr thread)
 			if (thread->entry) return(false);
 		}
 		else {
-			if (! thread->stack) return(false);
+			if (! thread->stack && ! ThreadStackPending(thread)) return(false);
 			if (! thread->entry) return(false);
 		}
 	}
 	return(true);
 }
 
+#endif /* THREAD_DEBUG >= 2 */
+
+#if THREAD_DEBUG
+
+/*	ThreadValid returns true if the 'thread' parameter is a valid thread.
+	This function is primarily for use during debugging, and is called
+	by the preconditions to most of the functions in Thread Library. You
+	will usually not need to call this function. So that this function can
+	easily be called from within other thread functions, the error code is not
+	set by this function. Unless THREAD_DEBUG is 2 or more, only the markers
+	at either end of the structure are checked. */
+static Boolean ThreadValid(ThreadPtr thread)
+{
+	if (! thread || ((long) thread & 1)) return(false);
+	if (thread->magic != THREAD_MAGIC) return(false);
+	if (thread->canary != THREAD_CANARY) return(false);
+	#if THREAD_DEBUG >= 2
+		if (! ThreadValidFull(thread)) return(false);
+	#endif
+	return(true);
+}
+
 #endif /* THREAD_DEBUG */
 
 /*----------------------------------------------------------------------------*/
@@ -383,8 +768,8 @@ static Boolean ThreadValid(ThreadPtr thread)
 	to additional information and global variables needed by the VBL task. */
 typedef struct {
 	VBLTask vbl;							/* VBL task record */
-	Ptr stack_bottom;						/* bottom of active thread's stack */
-	ThreadPtr thread;						/* thread being checked by stack sniffer */
+	Ptr volatile stack_bottom;			/* bottom of active thread's stack */
+	ThreadPtr volatile thread;			/* thread being checked by stack sniffer */
 	ThreadPtr *main;						/* pointer to gThread.main */
 	ThreadPtr *active;					/* pointer to gThread.active */
 	Boolean installed;					/* true if stack sniffer is installed */
@@ -468,6 +853,63 @@ static void StackSnifferResume(void)
 	
 #endif /* THREAD_STACK_SNIFFER */
 
+/*----------------------------------------------------------------------------*/
+/*	�Stack Painting */
+/*----------------------------------------------------------------------------*/
+
+/*	�When you define THREAD_STACK_PAINT as 1, every thread's stack is filled
+	with a known pattern when it's allocated. The deepest point a thread's
+	stack has reached can then be found by looking for the first long-word,
+	counting up from the bottom of the stack, that no longer contains the
+	pattern. This is used by ThreadStackPeak, ThreadStackReport, and
+	ThreadStackRecommended to help you pick stack sizes that are no larger
+	than each thread really needs. Painting a stack takes a little time
+	when the stack is allocated, but costs nothing during context switches.
+	Stack painting is enabled by default if THREAD_STACK_PAINT is not
+	already defined and THREAD_DEBUG is not zero. */
+#ifndef THREAD_STACK_PAINT
+	#define THREAD_STACK_PAINT		(THREAD_DEBUG)
+#endif
+
+/* the pattern written to unused parts of a stack */
+#define STACK_PAINT_PATTERN			('PANT')
+
+#if THREAD_STACK_PAINT
+
+/* StackPaint fills the memory from 'bottom' up to 'top' with the paint
+	pattern. Both addresses are rounded to long-words within the range. */
+static void StackPaint(Ptr bottom, Ptr top)
+{
+	register long *p;
+	register long *end;
+	
+	p = (long *) (((long) bottom + 3) & ~3L);
+	end = (long *) ((long) top & ~3L);
+	while (p < end)
+		*p++ = STACK_PAINT_PATTERN;
+}
+
+/* StackUsed returns the number of bytes from the top of a painted stack
+	down to the deepest point that has been used. */
+static size_t StackUsed(Ptr bottom, Ptr top)
+{
+	register long *p;
+	register long *end;
+	
+	p = (long *) (((long) bottom + 3) & ~3L);
+	end = (long *) ((long) top & ~3L);
+	while (p < end && *p == STACK_PAINT_PATTERN)
+		p++;
+	return(top - (Ptr) p);
+}
+
+#else /* THREAD_STACK_PAINT */
+
+	#define StackPaint(bottom, top)	((void) 0)
+	#define StackUsed(bottom, top)	((size_t) 0)
+
+#endif /* THREAD_STACK_PAINT */
+
 /*----------------------------------------------------------------------------*/
 /*	Everything up to this point was just definitions and utility functions.
 	This is where the real meat of the code begins. The code from here on
@@ -482,7 +924,7 @@ static void StackSnifferResume(void)
 	used to make removal of an arbitrary thread (not just the head of the
 	queue) efficient. */
 	
-#if THREAD_DEBUG
+#if THREAD_DEBUG >= 2
 
 /* ThreadQueueValid returns true if the queue is valid. */
 static Boolean ThreadQueueValid(ThreadQueuePtr queue)
@@ -498,7 +940,12 @@ static Boolean ThreadQueueValid(ThreadQueuePtr queue)
 	return(true);
 }
 
-#endif /* THREAD_DEBUG */
+#else /* THREAD_DEBUG >= 2 */
+
+	/* the queue is only checked at the higher debug level */
+	#define ThreadQueueValid(queue)	(true)
+
+#endif /* THREAD_DEBUG >= 2 */
 
 /* ThreadEnqueue adds the thread to the end of the queue. */
 static void ThreadEnqueue(ThreadQueuePtr queue, ThreadPtr thread)
@@ -527,6 +974,29 @@ static void ThreadEnqueue(ThreadQueuePtr queue, ThreadPtr thread)
 	ensure(ThreadQueueValid(queue));
 }
 
+/* ThreadSplice adds a chain of 'count' threads, from 'first' to 'last', to
+	the end of the queue in one step. The threads must already be linked to
+	each other, from first to last, through their next and prev fields. */
+static void ThreadSplice(ThreadQueuePtr queue, ThreadPtr first, ThreadPtr last,
+	short count)
+{
+	require(ThreadQueueValid(queue));
+	require(ThreadValid(first));
+	require(ThreadValid(last));
+	require(count > 0);
+	if (! queue->head)
+		queue->head = first;
+	else {
+		queue->tail->next = first;
+		first->prev = queue->tail;
+	}
+	last->next = queue->head;
+	queue->head->prev = last;
+	queue->tail = last;
+	queue->nelem += count;
+	ensure(ThreadQueueValid(queue));
+}
+
 /* ThreadDequeue removes the thread from the queue. */
 static void ThreadDequeue(ThreadQueuePtr queue, ThreadPtr thread)
 {
@@ -561,146 +1031,1109 @@ static void ThreadDequeue(ThreadQueuePtr queue, ThreadPtr thread)
 }
 
 /*----------------------------------------------------------------------------*/
-/*	�Error Handling */
-/*----------------------------------------------------------------------------*/
-
-/*	�ThreadError returns the last error that occurred, or noErr if the last
-	routine completed successfully. */
-OSErr ThreadError(void)
-{
-	return(gThread.error);
-}
-
-/*----------------------------------------------------------------------------*/
-/*	�Thread Serial Numbers */
+/* Private Memory Allocation */
 /*----------------------------------------------------------------------------*/
 
-/*	�Every thread is assigned a unique serial number. Serial numbers are used
-	to refer to threads, rather than using a pointer, since there is always
-	the possiblity that a thread may have terminated before a thread pointer
-	is used, which would make the thread pointer invalid. The specific
-	assignment of serial numbers to threads is not defined by the interface,
-	though every valid thread is guaranteed a non-zero serial number. You
-	should not assume that any thread will have a specific serial number. */
+/* size in bytes to which blocks in the reserved region are rounded */
+#define REGION_GRAIN					(8)
 
-/*	ThreadSN returns the thread's serial number. The error code is not changed. */
-static ThreadType ThreadSN(ThreadPtr thread)
+/* RegionInit allocates the reserved region set with ThreadReserveSet. The
+	region is a single nonrelocatable block, allocated early so that it sits
+	low in the heap, from which the stacks and structures of threads created
+	with THREAD_OPTION_RESERVED are carved. Returns true if successful or if
+	no region was requested, otherwise the error code is set. */
+static Boolean RegionInit(void)
 {
-	require(! thread || ThreadValid(thread));
-	return(thread ? thread->sn : THREAD_NONE);
+	size_t size;
+	
+	require(! gThread.region);
+	size = gThread.reserve & ~(REGION_GRAIN - 1);
+	if (size && MemAvailable(size)) {
+		gThread.region = NewPtr(size);
+		gThread.error = MemError();
+		if (gThread.region) {
+			gThread.region_size = size;
+			gThread.region_free = (RegionBlockPtr) gThread.region;
+			gThread.region_free->size = size;
+			gThread.region_free->next = NULL;
+		}
+	}
+	return(! size || gThread.region);
 }
 
-/*	Given the serial number of a thread, ThreadFromSN returns the corresponding
-	thread pointer, or NULL if there is no thread with the specified serial
-	number. If the thread is found the error code is cleared, otherwise it's
-	set to threadNotFoundErr. */
-static ThreadPtr ThreadFromSN(register ThreadType tsn)
+/* RegionDispose disposes of the reserved region, if there is one */
+static void RegionDispose(void)
 {
-	register ThreadPtr thread;
-	register short nthread;
-		
-	require(0 <= tsn && tsn <= gThread.lastsn);
-	thread = gThread.queue.head;
-	nthread = gThread.queue.nelem;
-	while (nthread-- > 0 && thread->sn != tsn)
-		thread = thread->next;
-	if (thread && thread->sn != tsn)
-		thread = NULL;
-	gThread.error = (thread ? noErr : threadNotFoundErr);
-	FailThreadError();
-	ensure(! thread || (ThreadValid(thread) && thread->sn == tsn));
-	return(thread);
+	if (gThread.region) {
+		DisposePtr(gThread.region);
+		gThread.region = NULL;
+		gThread.region_size = 0;
+		gThread.region_free = NULL;
+	}
 }
 
-/*----------------------------------------------------------------------------*/
-/*	�Accessing the Queue of Threads */
-/*----------------------------------------------------------------------------*/
-
-/*	�ThreadCount returns the number of threads in the queue. */
-short ThreadCount(void)
+/* RegionAlloc returns a block of the given size from the reserved region,
+	using the first free block that's large enough. Returns NULL if there's
+	no room, in which case the error code is set. */
+static Ptr RegionAlloc(size_t size)
 {
-	gThread.error = noErr;
-	return(gThread.queue.nelem);
+	RegionBlockPtr *link;			/* link to free block */
+	RegionBlockPtr block;			/* free block */
+	RegionBlockPtr rest;				/* part of block that's left over */
+	Ptr p;
+	
+	p = NULL;
+	size = (size + sizeof(size_t) + REGION_GRAIN - 1) & ~(REGION_GRAIN - 1);
+	link = &gThread.region_free;
+	while (*link && (*link)->size < size)
+		link = &(*link)->next;
+	block = *link;
+	if (block) {
+		if (block->size - size >= sizeof(RegionBlockType)) {
+			rest = (RegionBlockPtr) ((Ptr) block + size);
+			rest->size = block->size - size;
+			rest->next = block->next;
+			block->size = size;
+			*link = rest;
+		}
+		else
+			*link = block->next;
+		p = (Ptr) block + sizeof(size_t);
+	}
+	else
+		gThread.error = memFullErr;
+	return(p);
 }
 
-/*	�ThreadMain returns the main thread, or THREAD_NONE if there are no
-	threads. */
-ThreadType ThreadMain(void)
+/* RegionFree returns a block to the reserved region, merging it with
+	any free blocks next to it. */
+static void RegionFree(Ptr p)
 {
-	gThread.error = noErr;
-	return(ThreadSN(gThread.main));
+	RegionBlockPtr *link;			/* link to free block after this one */
+	RegionBlockPtr block;			/* block being freed */
+	RegionBlockPtr prev;				/* free block before this one */
+	
+	require(RegionContains(p));
+	block = (RegionBlockPtr) (p - sizeof(size_t));
+	prev = NULL;
+	link = &gThread.region_free;
+	while (*link && *link < block) {
+		prev = *link;
+		link = &(*link)->next;
+	}
+	block->next = *link;
+	*link = block;
+	if (block->next && (Ptr) block + block->size == (Ptr) block->next) {
+		block->size += block->next->size;
+		block->next = block->next->next;
+	}
+	if (prev && (Ptr) prev + prev->size == (Ptr) block) {
+		prev->size += block->size;
+		prev->next = block->next;
+	}
 }
 
-/*	�ThreadActive returns the currently active thread, or THREAD_NONE if
-	there are no threads. */
-ThreadType ThreadActive(void)
+/* ThreadMemNew allocates a block for a thread's stack or structure. With
+	THREAD_OPTION_TEMP_MEMORY the block is a locked handle in temporary
+	memory, which is returned in 'handle'; with THREAD_OPTION_RESERVED the
+	block comes from the reserved region. If neither is possible the block
+	is allocated in the application heap. Returns NULL if the block couldn't
+	be allocated, in which case the error code is set. */
+static Ptr ThreadMemNew(size_t size, ThreadOptionsType options, Handle *handle)
 {
-	gThread.error = noErr;
-	return(ThreadSN(gThread.active));
+	OSErr err;
+	Ptr p;
+	
+	p = NULL;
+	*handle = NULL;
+	if ((options & THREAD_OPTION_TEMP_MEMORY) && gThread.temp_memory) {
+		*handle = TempNewHandle(size, &err);
+		if (*handle) {
+			HLock(*handle);
+			p = **handle;
+		}
+	}
+	if (! p && (options & THREAD_OPTION_RESERVED) && gThread.region)
+		p = RegionAlloc(size);
+	if (! p && MemAvailable(size)) {
+		p = NewPtr(size);
+		gThread.error = MemError();
+	}
+	return(p);
 }
 
-/*	�ThreadFirst returns the first thread in the queue of threads, or
-	THREAD_NONE if there are no threads. */
-ThreadType ThreadFirst(void)
+/* ThreadMemDispose disposes of a block allocated with ThreadMemNew */
+static void ThreadMemDispose(Ptr p, Handle handle)
 {
-	gThread.error = noErr;
-	return(ThreadSN(gThread.queue.head));
+	if (handle)
+		DisposeHandle(handle);
+	else if (RegionContains(p))
+		RegionFree(p);
+	else
+		DisposePtr(p);
 }
 
-/*	�ThreadNext returns the next thread in the circular queue of threads. */
-ThreadType ThreadNext(ThreadType tsn)
+#if THREAD_STATIC_THREADS
+
+/* ThreadStructureNew returns a cleared thread structure from the table of
+	threads; the main thread gets the first entry. Returns NULL if the table
+	is full, in which case the error code is set. */
+static ThreadPtr ThreadStructureNew(ThreadOptionsType options)
 {
 	ThreadPtr thread;
+	short i;
 	
-	thread = ThreadFromSN(tsn);
-	return(thread ? ThreadSN(thread->next) : THREAD_NONE);
+	thread = NULL;
+	if (! gThread.main)
+		thread = gThreadTable;
+	else {
+		for (i = 1; i < THREAD_STATIC_THREADS && ! thread; i++) {
+			if (! gThreadTable[i].sn)
+				thread = gThreadTable + i;
+		}
+	}
+	if (thread) {
+		memset(thread, 0, sizeof(ThreadStructure));
+		thread->magic = THREAD_MAGIC;
+		thread->canary = THREAD_CANARY;
+	}
+	else
+		gThread.error = memFullErr;
+	return(thread);
 }
 
-/*----------------------------------------------------------------------------*/
-/*	�Thread Status */
-/*----------------------------------------------------------------------------*/
+/* ThreadStructureDispose returns the structure to the table of threads */
+static void ThreadStructureDispose(ThreadPtr thread)
+{
+	memset(thread, 0, sizeof(ThreadStructure));
+}
 
-/*	�ThreadStatus returns the status of the thread as set with ThreadStatusSet.
-	A new thread is initially assigned THREAD_STATUS_NORMAL. You can call
-	ThreadStatus periodically from within each thread (passing the result of
-	ThreadActive as the thread parameter) and should take whatever action is
-	specified by the return value. For instance, if ThreadStatus returns
-	THREAD_STATUS_QUIT, it means that the application is quitting and you
-	should exit the thread. Depending on the operation the thread is
-	performing, you may want to display an alert asking the user if
-	the thread should be exited. */
-ThreadStatusType ThreadStatus(ThreadType tsn)
+/* ThreadStackNew returns the thread's entry in the table of stacks. The
+	thread's stack and arena must both fit in it, otherwise NULL is returned
+	and the error code is set. */
+static Ptr ThreadStackNew(ThreadPtr thread)
 {
-	ThreadPtr thread;
+	Ptr stack;
 	
-	thread = ThreadFromSN(tsn);
-	return(thread ? thread->status : THREAD_STATUS_NORMAL);
+	stack = NULL;
+	if (thread->stack_size + thread->arena_size <= THREAD_STATIC_STACK)
+		stack = (Ptr) gThreadStacks[ThreadIndex(thread) - 1];
+	else
+		gThread.error = paramErr;
+	return(stack);
 }
 
-/*	�ThreadStatusSet sets the status code for the thread. It is the
-	responsibility of each thread to call ThreadStatus to determine what
-	action should be taken. For instance, when the user quits the application,
-	the application should call ThreadStatusSet with a THREAD_STATUS_QUIT
-	parameter for each thread in the queue of threads. Then, the application
-	should call ThreadYield, waiting for all other threads to exit before the
-	application itself exits. If you prefer not use the thread's status to
-	indicate to a thread that it should quit, then you could use some global
-	variable, say gQuitting, which the thread could check periodically.
+/* ThreadStackDispose does nothing, since stacks are in a static table */
+#define ThreadStackDispose(thread)	((void) 0)
 
-	Status values from THREAD_STATUS_NORMAL through THREAD_STATUS_RESERVED are
-	reserved for use by Thread Library. All other values can be used by the
-	application for its own purposes. */
-void ThreadStatusSet(ThreadType tsn, ThreadStatusType status)
+#else /* THREAD_STATIC_THREADS */
+
+/* ThreadStructureNew allocates and clears a thread structure. Returns NULL
+	if it couldn't be allocated, in which case the error code is set. Only
+	the stack is ever put in temporary memory, since the structure is
+	small. */
+static ThreadPtr ThreadStructureNew(ThreadOptionsType options)
 {
 	ThreadPtr thread;
+	Handle handle;						/* unused */
 	
-	thread = ThreadFromSN(tsn);
-	if (thread)
-		thread->status = status;
-	ensure(! thread || ThreadStatus(tsn) == status);
+	thread = (ThreadPtr) ThreadMemNew(sizeof(ThreadStructure),
+		options & THREAD_OPTION_RESERVED, &handle);
+	if (thread) {
+		memset(thread, 0, sizeof(ThreadStructure));
+		thread->magic = THREAD_MAGIC;
+		thread->canary = THREAD_CANARY;
+	}
+	return(thread);
 }
 
-/*----------------------------------------------------------------------------*/
+/* ThreadStructureDispose disposes of a thread structure. The marker is
+	cleared first so that a stale pointer to the thread won't pass
+	ThreadValid. The block holding a batch of threads is only disposed of
+	along with the last thread of the batch. */
+static void ThreadStructureDispose(ThreadPtr thread)
+{
+	BatchHeaderPtr batch;
+	
+	thread->magic = 0;
+	batch = thread->batch;
+	if (! batch)
+		ThreadMemDispose((Ptr) thread, NULL);
+	else if (--batch->live == 0)
+		ThreadMemDispose((Ptr) batch, batch->handle);
+}
+
+/* ThreadStackNew allocates a block for the thread's stack and arena.
+	Returns NULL if it couldn't be allocated, in which case the error
+	code is set. */
+static Ptr ThreadStackNew(ThreadPtr thread)
+{
+	return(ThreadMemNew(thread->stack_size + thread->arena_size,
+		thread->options, &thread->stack_handle));
+}
+
+/* ThreadStackDispose disposes of the block allocated by ThreadStackNew; the
+	stack of a thread in a batch goes with its structure */
+static void ThreadStackDispose(ThreadPtr thread)
+{
+	if (! thread->batch)
+		ThreadMemDispose(thread->stack, thread->stack_handle);
+}
+
+#endif /* THREAD_STATIC_THREADS */
+
+/*----------------------------------------------------------------------------*/
+/* Private Copy-Stack Operations */
+/*----------------------------------------------------------------------------*/
+
+/*	Threads created with THREAD_OPTION_COPY_STACK don't have stacks of their
+	own. Instead, they all execute on a single shared stack. Only one of them,
+	the owner, can have its frames on the shared stack at any time. When some
+	other copy-stack thread is activated, the owner's frames (everything from
+	its saved stack pointer up to the top of the shared stack) are copied into
+	a buffer just large enough to hold them, and the new thread's frames are
+	copied back onto the shared stack. This makes context switches between
+	copy-stack threads slower, but a thread that is mostly idle then costs
+	only the few hundred bytes it actually uses, instead of a whole stack.
+	Switches to and from threads with their own stacks (including the main
+	thread) don't copy anything, so the owner's frames stay in place until
+	another copy-stack thread needs the shared stack.
+	
+	The copying can't be done on the shared stack, since that would overwrite
+	the frames of the function doing the copying, so it's done in a separate
+	context with a small private stack. */
+
+/* buffers for saved frames are allocated in multiples of this size */
+#define COPY_STACK_GRAIN (256)
+
+static void ThreadSleepSetPtr(ThreadPtr thread, ThreadTicksType sleep);
+
+/* ThreadCopySwap moves the owner's frames off the shared stack and the
+	active thread's frames onto it. It is only called from the copier
+	context, whose stack is too small to allocate memory on, so the owner's
+	buffer was already sized by ThreadCopyReserve. If the owner is the
+	thread that was just suspended its stack pointer was only estimated
+	there, so the buffer is checked against the real size of its frames.
+	Should it be too small after all, the switch is abandoned: nothing has
+	been copied yet, so the suspended thread is simply made active again,
+	and the thread that was to be activated is put to sleep for a short
+	while. */
+static void ThreadCopySwap(void)
+{
+	register ThreadPtr owner;		/* thread whose frames are on shared stack */
+	register ThreadPtr thread;		/* thread being activated */
+	register Ptr top;					/* top of shared stack */
+	
+	owner = gThread.shared_owner;
+	thread = gThread.active;
+	top = gThread.shared + gThread.shared_size;
+	if (owner) {
+		owner->saved_size = top - (Ptr) ThreadContextSP(&owner->context);
+		check(owner->saved_size <= owner->saved_capacity);
+		if (owner->saved_size > owner->saved_capacity) {
+			owner->saved_size = 0;
+			ThreadSleepSetPtr(thread, STACK_RETRY_INTERVAL);
+			gThread.error = memFullErr;
+			gThread.active = owner;
+			return;
+		}
+		if (owner->saved_size > owner->stack_peak)
+			owner->stack_peak = owner->saved_size;
+		BlockMoveData(top - owner->saved_size, owner->saved, owner->saved_size);
+	}
+	if (thread->saved_size) {
+		BlockMoveData(thread->saved, top - thread->saved_size, thread->saved_size);
+		thread->saved_size = 0;
+	}
+	gThread.shared_owner = thread;
+}
+
+/* ThreadCopier is where the copier context starts executing, on its own
+	private stack, every time it's resumed. It resumes whichever thread
+	ThreadCopySwap leaves active. */
+static THREAD_NOINLINE void ThreadCopier(void)
+{
+	ThreadCopySwap();
+	ThreadContextLoad(&gThread.active->context);
+	check(false); /* doesn't return */
+}
+
+/* ThreadCopyInit allocates the shared stack and sets up the copier context.
+	It is called when the first copy-stack thread is created. The blocks
+	aren't stored in gThread until both have been allocated, since
+	allocating the second one can call ThreadGrowZone, which would dispose
+	of a shared stack that no copy-stack thread is using yet. Returns true
+	if successful, otherwise the error code is set. */
+static Boolean ThreadCopyInit(size_t stack_size)
+{
+	Ptr shared;							/* shared stack */
+	Ptr copier_stack;					/* copier's private stack */
+	
+	require(! gThread.shared && ! gThread.copier_stack);
+	shared = copier_stack = NULL;
+	if (MemAvailable(stack_size)) {
+		shared = NewPtr(stack_size);
+		gThread.error = MemError();
+	}
+	if (shared && MemAvailable(ThreadStackMinimum())) {
+		copier_stack = NewPtr(ThreadStackMinimum());
+		gThread.error = MemError();
+	}
+	if (copier_stack) {
+		gThread.shared = shared;
+		gThread.copier_stack = copier_stack;
+		gThread.shared_size = stack_size;
+		StackPaint(shared + sizeof(long), shared + stack_size);
+		ThreadContextStart(&gThread.copier,
+			copier_stack + ThreadStackMinimum(), ThreadCopier);
+	}
+	else if (shared)
+		DisposePtr(shared);
+	return(copier_stack != NULL);
+}
+
+/* ThreadCopyDispose disposes of the shared stack and the copier's stack. */
+static void ThreadCopyDispose(void)
+{
+	check(! gThread.shared_owner);
+	if (gThread.shared) {
+		DisposePtr(gThread.shared);
+		DisposePtr(gThread.copier_stack);
+		gThread.shared = gThread.copier_stack = NULL;
+		gThread.shared_size = 0;
+	}
+}
+
+/* ThreadCopyReserve makes sure that there's a buffer large enough to hold
+	the frames of the shared stack's owner before 'thread' is activated, so
+	that nothing can fail once the context switch has begun. If the owner is
+	the active thread then the address of a local variable is used as an
+	estimate of the stack pointer that will be saved in ThreadSwitch. The
+	stack pointer is saved at most two calls deeper than this function
+	(ThreadSwitch and ThreadContextSwitch, each of which needs a return
+	address, its arguments, and at most one frame of saved registers and
+	locals), so COPY_STACK_SLACK extra bytes are reserved to cover the
+	worst case; since buffers are allocated in multiples of
+	COPY_STACK_GRAIN anyway, this costs at most one more grain. Returns
+	false and sets the error code if there isn't enough memory. */
+static Boolean ThreadCopyReserve(ThreadPtr thread)
+{
+	#define COPY_STACK_SLACK (COPY_STACK_GRAIN)
+	ThreadPtr owner;					/* thread whose frames are on shared stack */
+	Ptr sp;								/* owner's stack pointer */
+	size_t need;						/* bytes needed to save owner's frames */
+	Ptr saved;							/* new buffer for owner's frames */
+	Boolean result;					/* true if buffer is large enough */
+	
+	result = true;
+	owner = gThread.shared_owner;
+	if ((thread->options & THREAD_OPTION_COPY_STACK) && owner && owner != thread) {
+		if (owner == gThread.active)
+			sp = (Ptr) &sp - COPY_STACK_SLACK;
+		else {
+			sp = (Ptr) ThreadContextSP(&owner->context);
+		}
+		need = gThread.shared + gThread.shared_size - sp;
+		if (need > owner->saved_capacity) {
+			need = (need + COPY_STACK_GRAIN - 1) & ~(COPY_STACK_GRAIN - 1);
+			saved = NULL;
+			if (MemAvailable(need)) {
+				saved = NewPtr(need);
+				gThread.error = MemError();
+			}
+			if (saved) {
+				if (owner->saved)
+					DisposePtr(owner->saved);
+				owner->saved = saved;
+				owner->saved_capacity = need;
+			}
+			else
+				result = false;
+		}
+	}
+	return(result);
+}
+
+/* ThreadTarget returns the context to resume to activate the thread.
+	Copy-stack threads whose frames aren't on the shared stack are
+	activated via the copier context. */
+#define ThreadTarget(thread) \
+	(((thread)->options & THREAD_OPTION_COPY_STACK) && \
+	 gThread.shared_owner != (thread) ? &gThread.copier : &(thread)->context)
+
+/* ThreadJump makes 'thread' the active thread and jumps to it, discarding
+	the context of the thread that was active. */
+static THREAD_NOINLINE void ThreadJump(ThreadPtr thread)
+{
+	gThread.active = thread;
+	ThreadContextLoad(ThreadTarget(thread));
+}
+
+/* ThreadSwitch makes 'thread' the active thread and switches to it, saving
+	the context of the thread that was active. ThreadSwitch returns when
+	that thread is next activated. */
+static THREAD_NOINLINE void ThreadSwitch(ThreadPtr thread)
+{
+	ThreadPtr previous;				/* thread being suspended */
+	
+	previous = gThread.active;
+	gThread.active = thread;
+	ThreadContextSwitch(&previous->context, ThreadTarget(thread));
+}
+
+/*----------------------------------------------------------------------------*/
+/* Private FPU Context */
+/*----------------------------------------------------------------------------*/
+
+/*	The registers of the floating point unit are only saved and restored for
+	threads created with THREAD_OPTION_FPU, or marked with ThreadFPUUse. The
+	FPU is owned by whichever of those threads used it last, and its context
+	is only switched when another thread that uses the FPU is activated, so
+	switches to and from threads that don't use the FPU cost nothing more
+	than a test of the thread's options. The main thread is assumed to use
+	the FPU if there is one.
+	
+	Since the application is normally compiled for the 68000, the assembler
+	won't accept FPU instructions, so they're written out as opcodes. The
+	saved context begins with the frame saved by fsave, which is followed,
+	unless the frame is a null frame (meaning the FPU hasn't been used since
+	it was reset), by the data and control registers. */
+
+/* Define THREAD_FPU as 0 to leave out support for the FPU. It's only
+	available with the hand-written context switch routines. */
+#ifndef THREAD_FPU
+	#define THREAD_FPU THREAD_ASM_SWITCH
+#endif
+
+#if THREAD_FPU
+
+/* size of largest frame saved by fsave (a busy frame on the 68882) */
+#define FPU_FRAME_SIZE				(216)
+
+/* size of saved FPU context: frame, fp0-fp7, and fpcr/fpsr/fpiar */
+#define FPU_STATE_SIZE				(FPU_FRAME_SIZE + 8 * 12 + 3 * 4)
+
+void ThreadFPUSave(Ptr state);
+void ThreadFPURestore(Ptr state);
+
+asm(
+	"	.text\n"
+	"	.even\n"
+	"	.globl	ThreadFPUSave\n"
+	"ThreadFPUSave:\n"
+	"	move.l	4(%sp),%a0\n"
+	"	.word	0xF310\n"				/* fsave (a0) */
+	"	tst.b	(%a0)\n"
+	"	beq.s	1f\n"
+	"	lea	216(%a0),%a1\n"
+	"	.word	0xF211,0xF0FF\n"		/* fmovem.x fp0-fp7,(a1) */
+	"	lea	96(%a1),%a1\n"
+	"	.word	0xF211,0xBC00\n"		/* fmovem.l fpcr/fpsr/fpiar,(a1) */
+	"1:	rts\n"
+	"	.globl	ThreadFPURestore\n"
+	"ThreadFPURestore:\n"
+	"	move.l	4(%sp),%a0\n"
+	"	tst.b	(%a0)\n"
+	"	beq.s	1f\n"
+	"	lea	216(%a0),%a1\n"
+	"	.word	0xF211,0xD0FF\n"		/* fmovem.x (a1),fp0-fp7 */
+	"	lea	96(%a1),%a1\n"
+	"	.word	0xF211,0x9C00\n"		/* fmovem.l (a1),fpcr/fpsr/fpiar */
+	"1:	.word	0xF350\n"				/* frestore (a0) */
+	"	rts\n"
+);
+
+/* ThreadFPUInit finds out whether there's an FPU. If there is, the FPU
+	initially belongs to the main thread, whose buffer for the FPU context
+	must then be allocated with ThreadFPUAllocate before any other thread
+	can take the FPU. */
+static void ThreadFPUInit(ThreadPtr main)
+{
+	long fpu;
+	
+	gThread.fpu = (Gestalt(gestaltFPUType, &fpu) == noErr && fpu != gestaltNoFPU);
+	gThread.fpu_owner = NULL;
+	if (gThread.fpu) {
+		main->options |= THREAD_OPTION_FPU;
+		gThread.fpu_owner = main;
+	}
+}
+
+/* ThreadFPUAllocate allocates the buffer in which the thread's FPU context
+	is saved, if the thread uses the FPU. A new context is all zeros, which
+	restores the FPU to its reset state. Returns false if the buffer couldn't
+	be allocated, in which case the error code is set. */
+static Boolean ThreadFPUAllocate(ThreadPtr thread)
+{
+	if (! gThread.fpu)
+		thread->options &= ~THREAD_OPTION_FPU;
+	else if ((thread->options & THREAD_OPTION_FPU) && ! thread->fpu_state &&
+				MemAvailable(FPU_STATE_SIZE))
+	{
+		thread->fpu_state = NewPtrClear(FPU_STATE_SIZE);
+		gThread.error = MemError();
+	}
+	return(! (thread->options & THREAD_OPTION_FPU) || thread->fpu_state);
+}
+
+/* ThreadFPUTake saves the FPU context of the thread that owns the FPU and
+	gives the FPU to the active thread */
+static void ThreadFPUTake(ThreadPtr thread)
+{
+	require(thread->fpu_state);
+	if (gThread.fpu_owner)
+		ThreadFPUSave(gThread.fpu_owner->fpu_state);
+	ThreadFPURestore(thread->fpu_state);
+	gThread.fpu_owner = thread;
+}
+
+/* ThreadFPUDispose disposes of the thread's FPU context */
+static void ThreadFPUDispose(ThreadPtr thread)
+{
+	if (thread == gThread.fpu_owner)
+		gThread.fpu_owner = NULL;
+	if (thread->fpu_state) {
+		DisposePtr(thread->fpu_state);
+		thread->fpu_state = NULL;
+	}
+}
+
+#else /* THREAD_FPU */
+
+	#define ThreadFPUInit(main)			((void) 0)
+	#define ThreadFPUAllocate(thread)	((thread)->options &= ~THREAD_OPTION_FPU, true)
+	#define ThreadFPUTake(thread)			((void) 0)
+	#define ThreadFPUDispose(thread)		((void) 0)
+	
+#endif /* THREAD_FPU */
+
+/*----------------------------------------------------------------------------*/
+/* Private Stack Allocation */
+/*----------------------------------------------------------------------------*/
+
+/* ThreadStackPrepare sets up everything that depends on where the stack
+	of a thread is, other than its context, once the stack has been
+	allocated. */
+static void ThreadStackPrepare(ThreadPtr thread)
+{
+	ThreadPtr main;					/* the main thread */
+	
+	thread->arena_next = thread->arena;
+
+	/* Since all threads other than the main thread use stacks
+		allocated in the application's heap, we need to disable the
+		stack sniffer VBL task by setting the low-memory global
+		variable StkLowPt to 0. Otherwise, the stack sniffer would
+		generate system error #28. */
+	LMSetStkLowPt(NULL);
+	
+	/* To help the stack sniffer catch stack overrun, we write a
+		long-word at the bottom of the thread's stack. */
+	*(long *) thread->stack = STACK_SNIFFER_SENTINEL;
+	
+	/* Certain low-memory globals divide the stack and heap.
+		We change these globals when a thread other than the
+		main thread is activated so that certain OS traps will
+		work correctly. */
+	thread->heapEnd = thread->stack;
+	thread->applLimit = thread->stack;
+	thread->hiHeapMark = thread->stack;
+	
+	/* A stack in temporary memory lies outside the application's
+		partition, possibly above it, where letting the Memory Manager
+		think the heap may grow up to the stack would be disastrous. So
+		these globals are never set higher than the main thread's. */
+	if (thread->stack_handle) {
+		main = gThread.main;
+		if (main == gThread.active) {
+			main->heapEnd = LMGetHeapEnd();
+			main->applLimit = LMGetApplLimit();
+			main->hiHeapMark = LMGetHiHeapMark();
+		}
+		if (thread->heapEnd > main->heapEnd)
+			thread->heapEnd = main->heapEnd;
+		if (thread->applLimit > main->applLimit)
+			thread->applLimit = main->applLimit;
+		if (thread->hiHeapMark > main->hiHeapMark)
+			thread->hiHeapMark = main->hiHeapMark;
+	}
+
+	/* paint the stack so we can find out how much of it is used; the
+		shared stack was painted when it was allocated */
+	if (! (thread->options & THREAD_OPTION_COPY_STACK))
+		StackPaint(thread->stack + sizeof(long), thread->stack + thread->stack_size);
+}
+
+/* ThreadStackAllocate allocates the thread's stack and sets up the parts of
+	the thread's context that depend on where the stack is. This is normally
+	done by ThreadBegin, but is delayed until the thread is first activated
+	if the thread was created with THREAD_OPTION_LAZY_STACK. Returns true
+	if the stack was allocated, otherwise the error code is set. */
+static void ThreadStart(void);
+
+static Boolean ThreadStackAllocate(ThreadPtr thread)
+{
+	require(! thread->stack);
+	require(thread->stack_size > 0);
+	
+	/* The main thread uses the application's regular stack, while
+		nonrelocatable blocks are allocated to contain the stacks of
+		all other threads. Since the stack persists until the thread
+		that created it terminates, you can create any object you
+		require on a thread's stack, including window records and parameter
+		blocks. The main advantage of using separate stacks, however,
+		is the speed of context switches. A context switch involves
+		only saving and loading a few registers; no time consuming saving
+		and restoring of stacks is necessary. */
+
+	/* Copy-stack threads all use the shared stack, which is allocated
+		when the first copy-stack thread is created and is as large as the
+		stack requested for that thread. Threads created later can't ask
+		for a larger stack. A copy-stack thread's arena gets a block of its
+		own, which is allocated first: until the thread is queued,
+		ThreadGrowZone would dispose of a newly allocated shared stack. */
+	if (thread->options & THREAD_OPTION_COPY_STACK) {
+		if (thread->arena_size && MemAvailable(thread->arena_size)) {
+			thread->arena = NewPtr(thread->arena_size);
+			gThread.error = MemError();
+		}
+		if ((thread->arena || ! thread->arena_size) &&
+			 (gThread.shared || ThreadCopyInit(thread->stack_size)))
+		{
+			if (thread->stack_size <= gThread.shared_size) {
+				thread->stack = gThread.shared;
+				thread->stack_size = gThread.shared_size;
+			}
+			else
+				gThread.error = paramErr;
+		}
+		if (thread->arena && ! thread->stack) {
+			DisposePtr(thread->arena);
+			thread->arena = NULL;
+		}
+	}
+	
+	/* The thread's arena, if it has one, is allocated in the same block
+		as its stack, just above the top of the stack. */
+	else {
+		thread->stack = ThreadStackNew(thread);
+		if (thread->stack && thread->arena_size)
+			thread->arena = thread->stack + thread->stack_size;
+	}
+	if (thread->stack) {
+		ThreadStackPrepare(thread);
+
+		/* Set up the thread's context so that the first time the thread
+			is activated ThreadStart is called at the top of its stack. For
+			a copy-stack thread this doesn't touch the shared stack, which
+			may be holding another thread's frames. */
+		ThreadContextStart(&thread->context, thread->stack + thread->stack_size,
+			ThreadStart);
+	}
+	return(thread->stack != NULL);
+}
+
+/* ThreadStackPeakPtr returns the most stack space used by the thread so far.
+	For threads with their own stacks (and for the main thread) the stack is
+	checked for the paint pattern. For copy-stack threads the size of the
+	largest set of frames moved off the shared stack is used, which may be
+	a little less than the true peak. */
+static size_t ThreadStackPeakPtr(ThreadPtr thread)
+{
+	size_t peak;						/* most stack used */
+	size_t used;						/* stack used by copy-stack thread now */
+	Ptr top;								/* top of shared stack */
+	
+	peak = 0;
+	if (thread == gThread.main) {
+		peak = StackUsed(thread == gThread.active ? LMGetApplLimit() : thread->applLimit,
+			LMGetCurStackBase());
+	}
+	else if (thread->options & THREAD_OPTION_COPY_STACK) {
+		peak = thread->stack_peak;
+		if (thread == gThread.shared_owner) {
+			top = gThread.shared + gThread.shared_size;
+			if (thread == gThread.active)
+				used = top - (Ptr) &used;
+			else {
+				used = top - (Ptr) ThreadContextSP(&thread->context);
+			}
+			if (used > peak)
+				peak = used;
+		}
+	}
+	else if (thread->stack)
+		peak = StackUsed(thread->stack + sizeof(long), thread->stack + thread->stack_size);
+	return(peak);
+}
+
+/* ThreadStackRecord records the thread's peak stack use in the table of
+	stack use by entry point, which is used by ThreadStackRecommended. If
+	the table is full then entry points not already in it are ignored. */
+static void ThreadStackRecord(ThreadPtr thread)
+{
+	StackTableType *table;			/* entry in table */
+	StackTableType *unused;			/* first unused entry in table */
+	size_t peak;						/* thread's peak stack use */
+	short i;
+	
+	peak = ThreadStackPeakPtr(thread);
+	if (thread->entry && peak) {
+		unused = NULL;
+		table = gThread.stack_table;
+		for (i = 0; i < STACK_TABLE_SIZE && table->entry != thread->entry; i++, table++) {
+			if (! table->entry && ! unused)
+				unused = table;
+		}
+		if (i == STACK_TABLE_SIZE && unused) {
+			table = unused;
+			table->entry = thread->entry;
+			table->peak = 0;
+		}
+		if (i < STACK_TABLE_SIZE || unused) {
+			if (peak > table->peak)
+				table->peak = peak;
+		}
+	}
+}
+
+/* ThreadDispose disposes of the memory allocated for the thread. The thread
+	must already have been removed from the queue of threads. */
+static void ThreadDispose(ThreadPtr thread)
+{
+	ThreadStackRecord(thread);
+	if (thread->stack && ! (thread->options & THREAD_OPTION_COPY_STACK))
+		ThreadStackDispose(thread);
+	if (thread->saved)
+		DisposePtr(thread->saved);
+	if (thread->arena && (thread->options & THREAD_OPTION_COPY_STACK))
+		DisposePtr(thread->arena);
+	ThreadFPUDispose(thread);
+	ThreadStructureDispose(thread);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Private Memory Recovery */
+/*----------------------------------------------------------------------------*/
+
+/* Define THREAD_GROW_ZONE as 0 if the application installs its own grow-zone
+	function and doesn't want Thread Library to chain in front of it. */
+#ifndef THREAD_GROW_ZONE
+	#define THREAD_GROW_ZONE (1)
+#endif
+
+#if THREAD_GROW_ZONE
+
+/* ThreadGrowZone is installed as the application heap's grow-zone function
+	by ThreadBeginMain. When the Memory Manager can't satisfy a request it
+	releases memory that Thread Library is holding but not using, and sets
+	the status of every thread with a normal status to
+	THREAD_STATUS_LOW_MEMORY so that threads can release memory they're
+	holding too. If nothing could be released then the grow-zone function
+	that was installed before ours is called. Returns the number of bytes
+	released.
+	
+	Only memory that can't be in use is released: the structure and stack
+	of a thread that ended but hasn't been disposed of yet, the unused part
+	of the buffers holding the frames of copy-stack threads, the shared
+	stack when there are no copy-stack threads, and the reserved region
+	when nothing has been allocated from it. The buffer belonging to the
+	thread whose frames are on the shared stack is left alone, since it's
+	about to be filled in. Since Retro68 addresses globals absolutely there's
+	no need to set up register A5 here. */
+static pascal long ThreadGrowZone(Size needed)
+{
+	ThreadPtr thread;					/* thread being examined */
+	Boolean copying;					/* true if there are copy-stack threads */
+	size_t size;						/* new size of buffer */
+	long released;						/* number of bytes released */
+	short i;
+	
+	released = 0;
+	thread = gThread.dispose;
+	if (thread && thread != gThread.active) {
+		#if ! THREAD_STATIC_THREADS
+			if (thread->stack && ! thread->stack_handle && ! thread->batch &&
+				 ! RegionContains(thread->stack) &&
+				 ! (thread->options & THREAD_OPTION_COPY_STACK))
+			{
+				released += GetPtrSize(thread->stack);
+			}
+		#endif
+		ThreadDispose(thread);
+		gThread.dispose = NULL;
+	}
+	copying = false;
+	thread = gThread.queue.head;
+	for (i = 0; i < gThread.queue.nelem; i++, thread = thread->next) {
+		if (thread->options & THREAD_OPTION_COPY_STACK)
+			copying = true;
+		if (thread->saved && thread != gThread.shared_owner) {
+			size = (thread->saved_size + COPY_STACK_GRAIN - 1) & ~(COPY_STACK_GRAIN - 1);
+			if (! size) {
+				DisposePtr(thread->saved);
+				thread->saved = NULL;
+			}
+			else if (size < thread->saved_capacity)
+				SetPtrSize(thread->saved, size);
+			else
+				size = thread->saved_capacity;
+			released += thread->saved_capacity - size;
+			thread->saved_capacity = size;
+		}
+		if (thread->status == THREAD_STATUS_NORMAL)
+			thread->status = THREAD_STATUS_LOW_MEMORY;
+	}
+	if (gThread.shared && ! copying && ! gThread.shared_owner) {
+		released += GetPtrSize(gThread.shared) + GetPtrSize(gThread.copier_stack);
+		ThreadCopyDispose();
+	}
+	if (gThread.region && (Ptr) gThread.region_free == gThread.region &&
+		 gThread.region_free->size == gThread.region_size)
+	{
+		released += gThread.region_size;
+		RegionDispose();
+	}
+	gThread.recovered += released;
+	if (! released && gThread.grow_prev)
+		released = gThread.grow_prev(needed);
+	return(released);
+}
+
+/* ThreadGrowZoneInstall installs ThreadGrowZone as the application heap's
+	grow-zone function. The zone header is changed directly, rather than
+	with SetGrowZone, since SetGrowZone affects the current zone, which
+	needn't be the application heap. */
+static void ThreadGrowZoneInstall(void)
+{
+	THz zone;
+	
+	zone = ApplicationZone();
+	gThread.grow_prev = zone->gzProc;
+	zone->gzProc = NewGrowZoneUPP(ThreadGrowZone);
+}
+
+/* ThreadGrowZoneRemove reinstalls the grow-zone function that was replaced
+	by ThreadGrowZoneInstall */
+static void ThreadGrowZoneRemove(void)
+{
+	ApplicationZone()->gzProc = gThread.grow_prev;
+	gThread.grow_prev = NULL;
+}
+
+#else /* THREAD_GROW_ZONE */
+
+	#define ThreadGrowZoneInstall()	((void) 0)
+	#define ThreadGrowZoneRemove()	((void) 0)
+
+#endif /* THREAD_GROW_ZONE */
+
+/*----------------------------------------------------------------------------*/
+/* Private Preemption */
+/*----------------------------------------------------------------------------*/
+
+/* ThreadPreemptTask is the Time Manager task installed by ThreadPreemptSet.
+	It runs at interrupt time, so it only asks for a context switch, which
+	is made the next time the active thread reaches a safe point (see
+	ThreadCheck), and primes itself to run again after another quantum.
+	Since globals are absolute with GCC the task can reach them without
+	setting up register a5. */
+static void ThreadPreemptTask(void)
+{
+	gThreadPreemptRequest = true;
+	PrimeTime((QElemPtr) &gThread.preempt_task, gThread.preempt_quantum);
+}
+
+/* ThreadPreemptRemove removes the Time Manager task, if it's installed */
+static void ThreadPreemptRemove(void)
+{
+	if (gThread.preempt_quantum) {
+		RmvTime((QElemPtr) &gThread.preempt_task);
+		gThread.preempt_quantum = 0;
+	}
+	gThreadPreemptRequest = false;
+}
+
+/* ThreadPreemptInstall replaces the Time Manager task with one that runs
+	every 'quantum' milliseconds, or just removes it if 'quantum' is zero.
+	Returns noErr, or unimpErr if the extended Time Manager isn't
+	available. */
+static OSErr ThreadPreemptInstall(long quantum)
+{
+	long version;
+	OSErr error;
+	
+	error = noErr;
+	ThreadPreemptRemove();
+	if (quantum) {
+		if (Gestalt(gestaltTimeMgrVersion, &version) != noErr ||
+			 version < gestaltExtendedTimeMgr)
+		{
+			error = unimpErr;
+		}
+		else {
+			memset(&gThread.preempt_task, 0, sizeof(gThread.preempt_task));
+			gThread.preempt_task.tmAddr = NewTimerUPP((TimerProcPtr) ThreadPreemptTask);
+			gThread.preempt_quantum = quantum;
+			InsXTime((QElemPtr) &gThread.preempt_task);
+			PrimeTime((QElemPtr) &gThread.preempt_task, quantum);
+		}
+	}
+	return(error);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Error Handling */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadError returns the last error that occurred, or noErr if the last
+	routine completed successfully. */
+OSErr ThreadError(void)
+{
+	return(gThread.error);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Thread Serial Numbers */
+/*----------------------------------------------------------------------------*/
+
+/*	�Every thread is assigned a unique serial number. Serial numbers are used
+	to refer to threads, rather than using a pointer, since there is always
+	the possiblity that a thread may have terminated before a thread pointer
+	is used, which would make the thread pointer invalid. The specific
+	assignment of serial numbers to threads is not defined by the interface,
+	though every valid thread is guaranteed a non-zero serial number. You
+	should not assume that any thread will have a specific serial number. */
+
+/*	ThreadSN returns the thread's serial number. The error code is not changed. */
+static ThreadType ThreadSN(ThreadPtr thread)
+{
+	require(! thread || ThreadValid(thread));
+	return(thread ? thread->sn : THREAD_NONE);
+}
+
+/* ThreadFind returns the thread with the given serial number, or NULL if
+	there's no such thread, without changing the error code. It's used
+	where a thread named by a record may have ended in the meantime. */
+static ThreadPtr ThreadFind(register ThreadType tsn)
+{
+	register ThreadPtr thread;
+	register short nthread;
+	
+	thread = gThread.queue.head;
+	nthread = gThread.queue.nelem;
+	while (nthread-- > 0 && thread->sn != tsn)
+		thread = thread->next;
+	if (thread && thread->sn != tsn)
+		thread = NULL;
+	return(thread);
+}
+
+/*	Given the serial number of a thread, ThreadFromSN returns the corresponding
+	thread pointer, or NULL if there is no thread with the specified serial
+	number. If the thread is found the error code is cleared, otherwise it's
+	set to threadNotFoundErr. */
+static ThreadPtr ThreadFromSN(register ThreadType tsn)
+{
+	register ThreadPtr thread;
+		
+	require(0 <= tsn && tsn <= gThread.lastsn);
+	thread = ThreadFind(tsn);
+	gThread.error = (thread ? noErr : threadNotFoundErr);
+	FailThreadError();
+	ensure(! thread || (ThreadValid(thread) && thread->sn == tsn));
+	return(thread);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Accessing the Queue of Threads */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadCount returns the number of threads in the queue. */
+short ThreadCount(void)
+{
+	gThread.error = noErr;
+	return(gThread.queue.nelem);
+}
+
+/*	�ThreadMain returns the main thread, or THREAD_NONE if there are no
+	threads. */
+ThreadType ThreadMain(void)
+{
+	gThread.error = noErr;
+	return(ThreadSN(gThread.main));
+}
+
+/*	�ThreadActive returns the currently active thread, or THREAD_NONE if
+	there are no threads. */
+ThreadType ThreadActive(void)
+{
+	gThread.error = noErr;
+	return(ThreadSN(gThread.active));
+}
+
+/*	�ThreadFirst returns the first thread in the queue of threads, or
+	THREAD_NONE if there are no threads. */
+ThreadType ThreadFirst(void)
+{
+	gThread.error = noErr;
+	return(ThreadSN(gThread.queue.head));
+}
+
+/*	�ThreadNext returns the next thread in the circular queue of threads. */
+ThreadType ThreadNext(ThreadType tsn)
+{
+	ThreadPtr thread;
+	
+	thread = ThreadFromSN(tsn);
+	return(thread ? ThreadSN(thread->next) : THREAD_NONE);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Thread Status */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadStatus returns the status of the thread as set with ThreadStatusSet.
+	A new thread is initially assigned THREAD_STATUS_NORMAL. You can call
+	ThreadStatus periodically from within each thread (passing the result of
+	ThreadActive as the thread parameter) and should take whatever action is
+	specified by the return value. For instance, if ThreadStatus returns
+	THREAD_STATUS_QUIT, it means that the application is quitting and you
+	should exit the thread. Depending on the operation the thread is
+	performing, you may want to display an alert asking the user if
+	the thread should be exited. */
+ThreadStatusType ThreadStatus(ThreadType tsn)
+{
+	ThreadPtr thread;
+	
+	thread = ThreadFromSN(tsn);
+	return(thread ? thread->status : THREAD_STATUS_NORMAL);
+}
+
+/*	�ThreadStatusSet sets the status code for the thread. It is the
+	responsibility of each thread to call ThreadStatus to determine what
+	action should be taken. For instance, when the user quits the application,
+	the application should call ThreadStatusSet with a THREAD_STATUS_QUIT
+	parameter for each thread in the queue of threads. Then, the application
+	should call ThreadYield, waiting for all other threads to exit before the
+	application itself exits. If you prefer not use the thread's status to
+	indicate to a thread that it should quit, then you could use some global
+	variable, say gQuitting, which the thread could check periodically.
+
+	Status values from THREAD_STATUS_NORMAL through THREAD_STATUS_RESERVED are
+	reserved for use by Thread Library. All other values can be used by the
+	application for its own purposes. */
+void ThreadStatusSet(ThreadType tsn, ThreadStatusType status)
+{
+	ThreadPtr thread;
+	
+	thread = ThreadFromSN(tsn);
+	if (thread)
+		thread->status = status;
+	ensure(! thread || ThreadStatus(tsn) == status);
+}
+
+/*----------------------------------------------------------------------------*/
 /*	�Application Defined Data */
 /*----------------------------------------------------------------------------*/
 
@@ -726,6 +2159,279 @@ void ThreadDataSet(ThreadType tsn, void *data)
 	ensure(! thread || ThreadData(tsn) == data);
 }
 
+/*----------------------------------------------------------------------------*/
+/*	�Thread-Local Storage */
+/*----------------------------------------------------------------------------*/
+
+/* ThreadKeysEnd is called when a thread ends, and calls the destructor of
+	each key for which the thread has a value other than NULL. The slot is
+	cleared before its destructor is called. */
+static void ThreadKeysEnd(ThreadPtr thread)
+{
+	void *value;
+	short i;
+	
+	for (i = 0; i < THREAD_KEYS; i++) {
+		value = thread->key[i];
+		if (value) {
+			thread->key[i] = NULL;
+			if (gThread.key_destructor[i])
+				ThreadCallBack(gThread.key_destructor[i], value);
+		}
+	}
+}
+
+/*	�ThreadKeyNew allocates a key for thread-local storage. Every thread has
+	a slot for the key, which holds NULL until the thread sets it with
+	ThreadKeySet. Unlike ThreadData, which has to look a thread up by its
+	serial number, ThreadKeyGet and ThreadKeySet go straight to the active
+	thread, so libraries can keep per-thread state without searching for
+	it. When a thread ends, the destructor, if it isn't NULL, is called with
+	each value other than NULL that the thread left in its slot; it's called
+	by the thread that ends the thread, which may not be the thread itself.
+	THREAD_KEY_NONE is returned, with the error code set to
+	threadTooManyReqsErr, if all THREAD_KEYS keys are in use. */
+ThreadKeyType ThreadKeyNew(ThreadProcType destructor)
+{
+	ThreadKeyType key;
+	
+	for (key = 0; key < THREAD_KEYS && gThread.key_used[key]; key++)
+		;
+	if (key < THREAD_KEYS) {
+		gThread.key_used[key] = true;
+		gThread.key_destructor[key] = destructor;
+		gThread.error = noErr;
+	}
+	else {
+		key = THREAD_KEY_NONE;
+		gThread.error = threadTooManyReqsErr;
+	}
+	FailThreadError();
+	return(key);
+}
+
+/*	�ThreadKeyDispose frees a key allocated with ThreadKeyNew. Every
+	thread's slot for the key is cleared without calling the destructor,
+	so any values still in the slots should be released first. */
+void ThreadKeyDispose(ThreadKeyType key)
+{
+	ThreadPtr thread;
+	short i;
+	
+	require(0 <= key && key < THREAD_KEYS && gThread.key_used[key]);
+	gThread.error = noErr;
+	thread = gThread.queue.head;
+	for (i = 0; i < gThread.queue.nelem; i++, thread = thread->next)
+		thread->key[key] = NULL;
+	gThread.key_used[key] = false;
+	gThread.key_destructor[key] = NULL;
+}
+
+/*	�ThreadKeyGet returns the active thread's value for the key. */
+void *ThreadKeyGet(ThreadKeyType key)
+{
+	require(0 <= key && key < THREAD_KEYS && gThread.key_used[key]);
+	require(ThreadValid(gThread.active));
+	gThread.error = noErr;
+	return(gThread.active->key[key]);
+}
+
+/*	�ThreadKeySet sets the active thread's value for the key. */
+void ThreadKeySet(ThreadKeyType key, void *value)
+{
+	require(0 <= key && key < THREAD_KEYS && gThread.key_used[key]);
+	require(ThreadValid(gThread.active));
+	gThread.error = noErr;
+	gThread.active->key[key] = value;
+	ensure(ThreadKeyGet(key) == value);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Memory for Threads */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadReserveSet sets the size of a region of memory to set aside for
+	threads when ThreadBeginMain is called, and must be called before
+	ThreadBeginMain. Threads created with THREAD_OPTION_RESERVED have their
+	structures and stacks allocated from the region rather than each as a
+	separate nonrelocatable block in the heap, which keeps the heap from
+	being fragmented when threads are created and ended at odd times. If
+	the region is full the memory is taken from the heap as usual. The
+	region is disposed of along with the main thread.
+	
+	Threads can also be created with THREAD_OPTION_TEMP_MEMORY to have their
+	stacks allocated from temporary memory, outside the application's
+	partition, when it's available. */
+void ThreadReserveSet(size_t size)
+{
+	require(! gThread.main);
+	gThread.error = noErr;
+	gThread.reserve = size;
+}
+
+/*	�ThreadMemoryRecovered returns the total number of bytes Thread Library
+	has released since ThreadBeginMain was called because the application
+	heap was full. When Thread Library's grow-zone function is called it
+	releases memory it's holding but not using, and sets the status of
+	every thread whose status is THREAD_STATUS_NORMAL to
+	THREAD_STATUS_LOW_MEMORY. A thread that sees this status should release
+	any memory it can do without, such as caches, and set its status back
+	to THREAD_STATUS_NORMAL. This isn't available if Thread Library was
+	compiled with THREAD_GROW_ZONE defined as 0, in which case zero is
+	always returned. */
+long ThreadMemoryRecovered(void)
+{
+	gThread.error = noErr;
+	return(gThread.recovered);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Thread Arenas */
+/*----------------------------------------------------------------------------*/
+
+/* Every block returned by ThreadAlloc is preceded by a header giving the
+	size class of the block, or one of the following values. */
+#define ARENA_LARGE					(ARENA_CLASSES)	/* larger than any class */
+#define ARENA_HEAP					(-1)				/* allocated with NewPtr */
+
+/* size in bytes of the smallest size class; each class is twice as large
+	as the one before it */
+#define ARENA_CLASS_MINIMUM		(8)
+
+typedef long ArenaHeaderType;
+
+/* ArenaClass returns the size class for a request of the given number of
+	bytes, or ARENA_LARGE if the request is larger than any size class. */
+static short ArenaClass(size_t size)
+{
+	short cls;
+	size_t bytes;
+	
+	cls = 0;
+	bytes = ARENA_CLASS_MINIMUM;
+	while (cls < ARENA_CLASSES && bytes < size) {
+		bytes <<= 1;
+		cls++;
+	}
+	return(cls);
+}
+
+/*	�ThreadArenaDefault returns the size of the arena given to threads
+	created from now on. The default is 0, meaning that threads are created
+	without an arena and ThreadAlloc simply calls NewPtr. */
+size_t ThreadArenaDefault(void)
+{
+	gThread.error = noErr;
+	return(gThread.arena_default);
+}
+
+/*	�ThreadArenaDefaultSet sets the size of the arena given to threads
+	created from now on. Threads that already exist keep their arenas. A
+	thread's arena is allocated together with its stack, so setting a
+	large arena also increases the memory needed by each thread. */
+void ThreadArenaDefaultSet(size_t size)
+{
+	gThread.error = noErr;
+	gThread.arena_default = (size + 3) & ~3L;
+}
+
+/*	�ThreadAlloc allocates a block of memory from the current thread's
+	arena. It is intended for the many small, short-lived allocations a
+	thread makes while it runs, and avoids calling the Memory Manager,
+	which would otherwise have to work with a heap whose limits change
+	on every context switch. Small requests are rounded up to one of
+	several size classes; freed blocks are kept on a list for each class
+	and reused. Larger requests are simply taken from the unused part of
+	the arena, and aren't reclaimed until ThreadArenaReset is called or the
+	thread ends. If the thread has no arena, or the arena is full, the
+	block is allocated with NewPtr instead. NULL is returned if the block
+	couldn't be allocated. Blocks must be released with ThreadFree, and
+	only by the thread that allocated them. */
+void *ThreadAlloc(size_t size)
+{
+	ThreadPtr thread;
+	ArenaHeaderType *block;
+	size_t bytes;
+	short cls;
+	
+	require(ThreadValid(gThread.active));
+	ThreadCheck();
+	gThread.error = noErr;
+	thread = gThread.active;
+	block = NULL;
+	cls = ArenaClass(size);
+	if (thread->arena) {
+		if (cls < ARENA_LARGE && thread->arena_free[cls]) {
+			block = (ArenaHeaderType *) thread->arena_free[cls] - 1;
+			thread->arena_free[cls] = *(void **) thread->arena_free[cls];
+		}
+		else {
+			if (cls < ARENA_LARGE)
+				bytes = (size_t) ARENA_CLASS_MINIMUM << cls;
+			else
+				bytes = (size + 3) & ~3L;
+			bytes += sizeof(ArenaHeaderType);
+			if (bytes <= thread->arena + thread->arena_size - thread->arena_next) {
+				block = (ArenaHeaderType *) thread->arena_next;
+				thread->arena_next += bytes;
+			}
+		}
+	}
+	if (! block) {
+		cls = ARENA_HEAP;
+		block = (ArenaHeaderType *) NewPtr(size + sizeof(ArenaHeaderType));
+		gThread.error = MemError();
+		if (! block && gThread.error == noErr)
+			gThread.error = memFullErr;
+	}
+	if (block)
+		*block++ = cls;
+	return(block);
+}
+
+/*	�ThreadFree releases a block allocated with ThreadAlloc. Passing NULL
+	does nothing. */
+void ThreadFree(void *p)
+{
+	ThreadPtr thread;
+	ArenaHeaderType *block;
+	
+	require(ThreadValid(gThread.active));
+	gThread.error = noErr;
+	thread = gThread.active;
+	if (p) {
+		block = (ArenaHeaderType *) p - 1;
+		if (*block == ARENA_HEAP)
+			DisposePtr((Ptr) block);
+		else {
+			check((Ptr) block >= thread->arena &&
+					(Ptr) block < thread->arena_next);
+			if (*block < ARENA_LARGE) {
+				*(void **) p = thread->arena_free[*block];
+				thread->arena_free[*block] = p;
+			}
+		}
+	}
+}
+
+/*	�ThreadArenaReset releases, all at once, every block the current
+	thread has allocated from its arena. This is much faster than freeing
+	the blocks one at a time, and also reclaims the space used by large
+	blocks. Blocks that ThreadAlloc had to allocate with NewPtr are not
+	affected and must still be released with ThreadFree. */
+void ThreadArenaReset(void)
+{
+	ThreadPtr thread;
+	short cls;
+	
+	require(ThreadValid(gThread.active));
+	gThread.error = noErr;
+	thread = gThread.active;
+	thread->arena_next = thread->arena;
+	for (cls = 0; cls < ARENA_CLASSES; cls++)
+		thread->arena_free[cls] = NULL;
+}
+
 /*----------------------------------------------------------------------------*/
 /*	�Information About the Stack */
 /*----------------------------------------------------------------------------*/
@@ -746,14 +2452,19 @@ size_t ThreadStackMinimum(void)
 size_t ThreadStackDefault(void)
 {
 	gThread.error = noErr;
-	return(LMGetDefltStack());
+	#if THREAD_STATIC_THREADS
+		return(THREAD_STATIC_STACK - gThread.arena_default);
+	#else
+		return(LMGetDefltStack());
+	#endif
 }
 
 /*	�ThreadStackSpace returns the amount of stack space remaining in the
 	specified thread. There are at least the returned number of bytes
 	between the thread's stack pointer and the bottom of the thread's
 	stack, though slightly more space may be available to the application
-	due to overhead from Thread Library.
+	due to overhead from Thread Library. Zero is returned for a thread
+	whose stack hasn't been allocated yet (see ThreadBeginOptions).
 	
 		NOTE: The trap StackSpace will return incorrect results if called from
 		any thread other than the main thread. Likewise, using ApplLimit, HeapEnd,
@@ -765,92 +2476,752 @@ size_t ThreadStackSpace(ThreadType tsn)
 {
 	size_t result;
 	Ptr stack_bottom;
-	jmp_buf registers;
+	ThreadContextType registers;
 	ThreadPtr thread;
 	
 	result = 0;
 	thread = ThreadFromSN(tsn);
-	if (thread) {
+	if (thread && ! ThreadStackPending(thread)) {
 		if (thread == gThread.main)
 			stack_bottom = GetApplLimit();
 		else
 			stack_bottom = thread->stack;
 		if (thread == gThread.active) {
-			(void) setjmp(registers);
-			// check((Ptr) registers[a7] >= stack_bottom);
-			check((Ptr) registers[JMP_BUF_A7_INDEX] >= stack_bottom);
-			// result = (Ptr) registers[a7] - stack_bottom;
-			result = (Ptr) registers[JMP_BUF_A7_INDEX] - stack_bottom;
+			ThreadContextGet(&registers);
+			check((Ptr) ThreadContextSP(&registers) >= stack_bottom);
+			result = (Ptr) ThreadContextSP(&registers) - stack_bottom;
 		}
 		else {
-			// check((Ptr) thread->jmpenv[a7] >= stack_bottom);
-			check((Ptr) thread->jmpenv[JMP_BUF_A7_INDEX] >= stack_bottom);
-			// result = (Ptr) thread->jmpenv[a7] - stack_bottom;
-			result = (Ptr) thread->jmpenv[JMP_BUF_A7_INDEX] - stack_bottom;
+			check((Ptr) ThreadContextSP(&thread->context) >= stack_bottom);
+			result = (Ptr) ThreadContextSP(&thread->context) - stack_bottom;
 		}
 	}
 	ensure(result >= 0);
 	return(result);
 }
 
-/*----------------------------------------------------------------------------*/
-/*	�Support for Segmentation */
-/*----------------------------------------------------------------------------*/
-
-/*	�ThreadStackFrame returns information about the specified thread's
-	stack and stack frame. This information is needed for executing
-	a stack trace during automatic segment unloading in SegmentLib.c,
-	which is part of Winter Shell. You should never need to call this
-	function. This function will work correctly even if no threads exist. */
-void ThreadStackFrame(ThreadType tsn, ThreadStackFrameType *frame)
+/*	�ThreadStackPeak returns the most stack space the thread has used
+	since it was created. This is only known if Thread Library was compiled
+	with stack painting enabled (see Stack Painting above); otherwise, zero
+	is returned for all threads other than copy-stack threads. The value
+	returned for a copy-stack thread is the largest number of bytes that
+	had to be saved when its frames were moved off the shared stack. */
+size_t ThreadStackPeak(ThreadType tsn)
+{
+	ThreadPtr thread;
+	
+	thread = ThreadFromSN(tsn);
+	return(thread ? ThreadStackPeakPtr(thread) : 0);
+}
+
+/*	�ThreadStackReport fills the 'usage' array with the stack size and
+	peak stack use of up to 'count' threads, starting with the first thread
+	in the queue of threads, and returns the total number of threads. You
+	can pass a count of zero to find out how large an array is needed. The
+	peak stack use of each thread is also recorded for ThreadStackRecommended. */
+short ThreadStackReport(ThreadStackUsageType *usage, short count)
+{
+	ThreadPtr thread;
+	short i;
+	
+	require(count == 0 || usage != NULL);
+	gThread.error = noErr;
+	thread = gThread.queue.head;
+	for (i = 0; i < gThread.queue.nelem; i++, thread = thread->next) {
+		check(ThreadValid(thread));
+		ThreadStackRecord(thread);
+		if (i < count) {
+			usage[i].thread = thread->sn;
+			usage[i].entry = thread->entry;
+			usage[i].size = (thread == gThread.main ?
+				LMGetCurStackBase() - thread->applLimit : thread->stack_size);
+			usage[i].peak = ThreadStackPeakPtr(thread);
+		}
+	}
+	return(gThread.queue.nelem);
+}
+
+/*	�ThreadStackRecommended returns a recommended stack size for threads
+	with the specified entry point, or zero if nothing is known about the
+	stack use of such threads. The recommendation is based on the most
+	stack space used by any thread with the entry point, whether it has
+	ended or is still running, with room to spare for deeper calls and
+	interrupt routines. Stack use is recorded when a thread ends and when
+	ThreadStackReport is called. You can pass the value returned by this
+	function to ThreadBegin, or create threads with the option
+	THREAD_OPTION_STACK_AUTOSIZE and a zero stack size to have the
+	recommended size used automatically. */
+size_t ThreadStackRecommended(ThreadProcType entry)
+{
+	#define STACK_RECOMMEND_SLACK (1024)
+	#define STACK_RECOMMEND_GRAIN (256)
+	StackTableType *table;
+	size_t result;
+	short i;
+	
+	require(entry != NULL);
+	gThread.error = noErr;
+	result = 0;
+	table = gThread.stack_table;
+	for (i = 0; i < STACK_TABLE_SIZE && table->entry != entry; i++)
+		table++;
+	if (i < STACK_TABLE_SIZE && table->peak) {
+		result = table->peak + table->peak / 2 + STACK_RECOMMEND_SLACK;
+		result = (result + STACK_RECOMMEND_GRAIN - 1) & ~(STACK_RECOMMEND_GRAIN - 1);
+		if (result < LMGetMinStack())
+			result = LMGetMinStack();
+	}
+	return(result);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Support for Segmentation */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadStackFrame returns information about the specified thread's
+	stack and stack frame. This information is needed for executing
+	a stack trace during automatic segment unloading in SegmentLib.c,
+	which is part of Winter Shell. You should never need to call this
+	function. This function will work correctly even if no threads exist.
+	All fields are set to NULL for a thread whose stack hasn't been allocated
+	yet, since such a thread has no stack frames. */
+void ThreadStackFrame(ThreadType tsn, ThreadStackFrameType *frame)
+{
+	ThreadPtr thread;
+	ThreadContextType registers;
+	
+	/* initialize and convert serial number into a thread pointer */
+	frame->stack_top = frame->stack_bottom = frame->register_a6 = NULL;
+	thread = (tsn ? ThreadFromSN(tsn) : NULL);
+	if (thread && ThreadStackPending(thread))
+		return;
+
+	/* Get the top of the thread's stack. All threads other than the main
+		thread use their own private stacks. If no thread is specified
+		then the top of the stack defaults to the top of the application's
+		stack. */
+	if (thread && thread->stack) {
+		check(thread != gThread.main);
+		frame->stack_top = thread->stack + thread->stack_size;
+	}
+	else {
+		check(thread == gThread.main);
+		frame->stack_top = LMGetCurStackBase();
+	}
+
+	if (thread == gThread.active) {
+		/* Registers a6 and a7 point into the active thread's stack so we can
+			use their current values. This is the default case if there are no
+			threads (in which case 'thread' and gThread.active are both null). */
+		check(! thread || ThreadValid(thread));
+		ThreadContextGet(&registers);
+		frame->stack_bottom = (Ptr) ThreadContextSP(&registers);
+		frame->register_a6 = *(Ptr *) ThreadContextA6(&registers);
+	}
+	else {
+		/* For inactive threads, we use the values of registers a6 and a7 that
+			were saved when the thread was suspended. */
+		check(ThreadValid(thread));
+		frame->stack_bottom = (Ptr) ThreadContextSP(&thread->context);
+		frame->register_a6 = (Ptr) ThreadContextA6(&thread->context);
+		
+		/* The frames of a copy-stack thread may have been moved off the
+			shared stack, in which case there are no frames to trace. */
+		if ((thread->options & THREAD_OPTION_COPY_STACK) &&
+			 thread != gThread.shared_owner)
+		{
+			frame->register_a6 = NULL;
+		}
+	}
+	ensure(! frame->register_a6 ||
+			(frame->stack_bottom <= frame->register_a6 &&
+		 	 frame->register_a6 <= frame->stack_top));
+	ensure((Ptr) 0 < frame->stack_bottom &&
+			 frame->stack_bottom <= frame->stack_top);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Floating Point */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadFPUUse marks the thread as using the floating point unit, just as
+	if it had been created with THREAD_OPTION_FPU. The FPU's registers are
+	then preserved for the thread when other threads that use the FPU run.
+	A thread should be marked before it first uses the FPU. The main thread
+	is always marked if there's an FPU. Nothing is done if there's no FPU. */
+void ThreadFPUUse(ThreadType tsn)
+{
+	ThreadPtr thread;
+	
+	thread = ThreadFromSN(tsn);
+	if (thread && ! (thread->options & THREAD_OPTION_FPU)) {
+		thread->options |= THREAD_OPTION_FPU;
+		if (! ThreadFPUAllocate(thread))
+			thread->options &= ~THREAD_OPTION_FPU;
+		else if (thread == gThread.active && (thread->options & THREAD_OPTION_FPU))
+			ThreadFPUTake(thread);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Preemption */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadPreemptSet asks for the active thread to be preempted after it
+	has run for 'quantum' milliseconds without yielding; a quantum of zero
+	turns preemption off, which is the default. Preemption only ever
+	happens at a safe point: when the thread calls ThreadCheck or
+	ThreadAlloc, or passes a THREAD_CHECK macro. A Time Manager task sets
+	a flag at the end of each quantum, and the flag is cleared whenever
+	another thread is activated, so a thread that yields often enough is
+	never preempted. No context switch is ever made at interrupt time.
+	The extended Time Manager is required; if it isn't available the
+	error code is set to unimpErr. The quantum is also set whenever the
+	scheduling profile changes (see ThreadProfileSet). */
+void ThreadPreemptSet(long quantum)
+{
+	require(ThreadValid(gThread.main));
+	require(quantum >= 0);
+	gThread.error = ThreadPreemptInstall(quantum);
+	FailThreadError();
+}
+
+/*	�ThreadPreempt returns the quantum set by ThreadPreemptSet, or zero if
+	preemption is turned off. */
+long ThreadPreempt(void)
+{
+	gThread.error = noErr;
+	return(gThread.preempt_quantum);
+}
+
+/*	�ThreadCheck yields to the next scheduled thread if the active thread
+	has used up its quantum (see ThreadPreemptSet), and otherwise returns
+	at once. Call it, or use the cheaper THREAD_CHECK macro, in any loop
+	that can run for a long time without yielding. It must not be called
+	at interrupt time. Nothing is done while Thread Library is calling one
+	of the application's functions in the middle of its own work (a
+	thread's suspend or resume function, a key's destructor, or a function
+	posted with ThreadPost), since a context switch can't be made from
+	there; the thread is preempted at its next safe point instead. */
+void ThreadCheck(void)
+{
+	require(ThreadValid(gThread.active));
+	if (gThreadPreemptRequest && ! gThread.busy) {
+		gThreadPreemptRequest = false;
+		ThreadYield(0);
+	}
+}
+
+/* Define THREAD_PREEMPT_INSTRUMENT as 1 to make every function entry in code
+	compiled with GCC's -finstrument-functions option a safe point, so that
+	long-running code can be preempted without adding calls to ThreadCheck.
+	Thread Library itself, and any code that runs at interrupt time, must
+	be compiled without the option (-finstrument-functions-exclude-file-list
+	can be used to leave them out), since a context switch can't be made
+	from inside Thread Library or from an interrupt. Application functions
+	that Thread Library calls in the middle of a context switch can be
+	instrumented, since the hook does nothing while they run (see
+	ThreadCheck). */
+#ifndef THREAD_PREEMPT_INSTRUMENT
+	#define THREAD_PREEMPT_INSTRUMENT (0)
+#endif
+
+#if THREAD_PREEMPT_INSTRUMENT
+
+#define THREAD_NO_INSTRUMENT __attribute__((no_instrument_function))
+
+void __cyg_profile_func_enter(void *function, void *caller) THREAD_NO_INSTRUMENT;
+void __cyg_profile_func_exit(void *function, void *caller) THREAD_NO_INSTRUMENT;
+
+/* __cyg_profile_func_enter is called on entry to every instrumented
+	function; the active thread yields if it has used up its quantum. Nothing
+	is done before ThreadBeginMain or after the main thread has ended. */
+void __cyg_profile_func_enter(void *function, void *caller)
+{
+	if (gThreadPreemptRequest && gThread.main && ! gThread.busy)
+		ThreadCheck();
+}
+
+/* __cyg_profile_func_exit is called on exit from every instrumented
+	function, and does nothing */
+void __cyg_profile_func_exit(void *function, void *caller)
+{
+}
+
+#endif /* THREAD_PREEMPT_INSTRUMENT */
+
+/*----------------------------------------------------------------------------*/
+/*	�Posting from Interrupt Code */
+/*----------------------------------------------------------------------------*/
+
+/* ThreadPostTake removes the first record from the queue of posted records
+	and returns it, or returns NULL if the queue is empty. */
+static ThreadPostPtr ThreadPostTake(void)
+{
+	ThreadPostPtr post;
+	
+	post = (ThreadPostPtr) gThread.post.qHead;
+	if (post) {
+		Dequeue((QElemPtr) post, &gThread.post);
+		post->posted = false;
+	}
+	return(post);
+}
+
+/* ThreadPostDrain carries out the requests in all records posted since it
+	was last called: each thread named in a record is woken up, and each
+	function is called. It's called at the start of ThreadSchedulePtr, so
+	that a thread woken from interrupt code is scheduled by the very next
+	yield. Records for threads that have since ended are ignored. */
+static void ThreadPostDrain(void)
+{
+	ThreadPostPtr post;
+	ThreadPtr thread;
+	
+	while ((post = ThreadPostTake()) != NULL) {
+		if (post->thread != THREAD_NONE) {
+			thread = ThreadFind(post->thread);
+			if (thread)
+				thread->wake = 0;
+		}
+		if (post->proc)
+			ThreadCallBack(post->proc, post->data);
+	}
+}
+
+/*	�ThreadPost posts a record from interrupt code: a completion routine,
+	VBL task, Time Manager task, or the like. Such code can't call any
+	other function in Thread Library, since it could run while the queue
+	of threads is being changed. The record is put on a separate queue
+	with the Operating System's Enqueue routine, which disables interrupts
+	while it works, and the queue is emptied the next time a thread yields.
+	Then the thread given by the record's 'thread' field, if it isn't
+	THREAD_NONE, is woken up as if by ThreadSleepSet(thread, 0), and the
+	function in its 'proc' field, if it isn't NULL, is called with the
+	'data' field; the function is called by whichever thread yielded, and
+	must not yield itself.
+	
+	Since the main thread may be asleep in WaitNextEvent, waiting for no
+	more than ThreadYieldInterval allowed when the record was posted, the
+	application's process is woken up with the Process Manager's
+	WakeUpProcess, which can be called at interrupt time, so that the
+	record is handled at once instead of when the next event arrives.
+	
+	The record belongs to the caller, and must remain valid until it has
+	been handled; nothing is allocated, so it's safe to call ThreadPost at
+	interrupt time. Posting a record that is already posted does nothing,
+	but a record must not be posted by two interrupt routines that can
+	interrupt each other. */
+void ThreadPost(ThreadPostPtr post)
+{
+	if (! post->posted) {
+		post->posted = true;
+		Enqueue((QElemPtr) post, &gThread.post);
+		if (gThread.wake_process)
+			(void) WakeUpProcess(&gThread.process);
+	}
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Events */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadEventChecks returns the number of times the scheduler has called
+	EventAvail to look for events since ThreadBeginMain was called. (See
+	ThreadSchedule.) */
+long ThreadEventChecks(void)
+{
+	gThread.error = noErr;
+	return(gThread.event_checks);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Running Functions in the Main Thread */
+/*----------------------------------------------------------------------------*/
+
+/* MainCallsInit puts every record in the pool of calls on the free list */
+static void MainCallsInit(void)
+{
+	short i;
+	
+	gThread.call_free = NULL;
+	gThread.call_head = gThread.call_tail = NULL;
+	for (i = 0; i < THREAD_MAIN_CALLS; i++) {
+		gThread.call_pool[i].caller = THREAD_NONE;
+		gThread.call_pool[i].next = gThread.call_free;
+		gThread.call_free = &gThread.call_pool[i];
+	}
+}
+
+/* MainCallsForget is called when a thread ends, and frees the records of
+	calls that the thread was waiting for but that have already been made;
+	the thread would have freed them when it resumed. Calls it was waiting
+	for that haven't been made yet are freed by ThreadMainDrain. */
+static void MainCallsForget(ThreadPtr thread)
+{
+	MainCallPtr call;
+	short i;
+	
+	for (i = 0; i < THREAD_MAIN_CALLS; i++) {
+		call = &gThread.call_pool[i];
+		if (call->caller == thread->sn && call->done) {
+			call->caller = THREAD_NONE;
+			call->next = gThread.call_free;
+			gThread.call_free = call;
+		}
+	}
+}
+
+/*	�ThreadMainCall arranges for the main thread to call 'proc', passing it
+	'data'. Use it for Toolbox calls that are only safe from the main
+	thread, such as drawing in a window or handling events. The call is
+	made the next time the main thread calls ThreadMainDrain, and queuing
+	a call wakes the main thread, so that it runs at its next turn even if
+	it's sleeping. If 'wait' is true then the active thread sleeps until the call
+	has been made, otherwise ThreadMainCall returns at once. The function is
+	called at once if the active thread is the main thread. Calls are kept
+	in a pool of THREAD_MAIN_CALLS records, so nothing is allocated; if
+	every record is in use then the active thread yields until one is
+	free. */
+void ThreadMainCall(ThreadProcType proc, void *data, Boolean wait)
+{
+	MainCallPtr call;
+	
+	require(ThreadValid(gThread.active));
+	require(proc != NULL);
+	gThread.error = noErr;
+	if (gThread.active == gThread.main)
+		proc(data);
+	else {
+		while (! gThread.call_free)
+			ThreadYield(0);
+		call = gThread.call_free;
+		gThread.call_free = call->next;
+		call->next = NULL;
+		call->proc = proc;
+		call->data = data;
+		call->caller = (wait ? gThread.active->sn : THREAD_NONE);
+		call->done = false;
+		if (gThread.call_tail)
+			gThread.call_tail->next = call;
+		else
+			gThread.call_head = call;
+		gThread.call_tail = call;
+		gThread.main->wake = 0;
+		if (wait) {
+			while (! call->done)
+				ThreadYield(THREAD_TICKS_MAX);
+			call->caller = THREAD_NONE;
+			call->next = gThread.call_free;
+			gThread.call_free = call;
+		}
+	}
+}
+
+/*	�ThreadMainDrain makes all of the calls requested with ThreadMainCall
+	since it was last called, in the order in which they were requested, and
+	wakes any threads waiting for them. It must be called by the main
+	thread, usually once each time through the event loop. Calls requested
+	while the calls are being made are left for the next ThreadMainDrain.
+	A call whose waiting thread has ended in the meantime is still made,
+	but there's no one left to wake. Returns the number of calls made. */
+short ThreadMainDrain(void)
+{
+	MainCallPtr batch;
+	MainCallPtr call;
+	ThreadPtr caller;
+	short count;
+	
+	require(gThread.active == gThread.main);
+	gThread.error = noErr;
+	count = 0;
+	batch = gThread.call_head;
+	gThread.call_head = gThread.call_tail = NULL;
+	while (batch) {
+		call = batch;
+		batch = call->next;
+		call->proc(call->data);
+		count++;
+		caller = (call->caller != THREAD_NONE ? ThreadFind(call->caller) : NULL);
+		if (caller) {
+			call->done = true;
+			caller->wake = 0;
+		}
+		else {
+			call->caller = THREAD_NONE;
+			call->next = gThread.call_free;
+			gThread.call_free = call;
+		}
+	}
+	return(count);
+}
+
+/* default number of ticks between the scheduler's calls to EventAvail */
+#define EVENT_PENDING_INTERVAL (15)
+
+/* Define THREAD_HEADLESS as 1 for a faceless application, to leave all of
+	the scheduler's event checks out of Thread Library; it's then as if the
+	main thread were always created with THREAD_OPTION_HEADLESS. */
+#ifndef THREAD_HEADLESS
+	#define THREAD_HEADLESS (0)
+#endif
+
+/* ThreadHeadless is true if the scheduler doesn't look for events */
+#if THREAD_HEADLESS
+	#define ThreadHeadless()	(true)
+#else
+	#define ThreadHeadless()	(gThread.headless)
+#endif
+
+/* ThreadFallback is the thread the scheduler returns when events are
+	pending or no other thread is ready: the main thread, or the thread
+	running a nested scheduler (see ThreadSchedulerRun). */
+#define ThreadFallback() \
+	(gThread.scheduler->owner ? gThread.scheduler->owner : gThread.main)
+
+/*----------------------------------------------------------------------------*/
+/*	�Scheduling Profiles */
+/*----------------------------------------------------------------------------*/
+
+/* ThreadProfileDefaults sets the profiles used until the application sets
+	its own. In the foreground, bulk threads get a quarter of the turns
+	they would otherwise get; in the background every class gets all its
+	turns, and EventAvail is called less often. */
+static void ThreadProfileDefaults(void)
+{
+	ThreadProfilePtr profile;
+	short i;
+	
+	for (i = THREAD_PROFILE_FOREGROUND; i <= THREAD_PROFILE_BACKGROUND; i++) {
+		profile = &gThread.profile[i];
+		profile->quantum = 0;
+		profile->event_interval = EVENT_PENDING_INTERVAL;
+		profile->weight[THREAD_CLASS_NORMAL] = THREAD_WEIGHT_MAX;
+		profile->weight[THREAD_CLASS_INTERACTIVE] = THREAD_WEIGHT_MAX;
+		profile->weight[THREAD_CLASS_BULK] = THREAD_WEIGHT_MAX;
+	}
+	gThread.profile[THREAD_PROFILE_FOREGROUND].weight[THREAD_CLASS_BULK] = THREAD_WEIGHT_MAX / 4;
+	gThread.profile[THREAD_PROFILE_BACKGROUND].event_interval = 2 * EVENT_PENDING_INTERVAL;
+	gThread.background = false;
+}
+
+/* ThreadProfileApply puts the profile for the application's current state
+	into effect; its weights are those of the default scheduler. The
+	preemption quantum is only changed if it differs from
+	the profile's, so that a failure to install the Time Manager task
+	isn't retried every time. */
+static void ThreadProfileApply(void)
+{
+	ThreadProfilePtr profile;
+	
+	profile = &gThread.profile[gThread.background];
+	if (profile->quantum != gThread.preempt_quantum)
+		(void) ThreadPreemptInstall(profile->quantum);
+	BlockMoveData(profile->weight, gThread.root.weight, sizeof(profile->weight));
+}
+
+#if ! THREAD_HEADLESS
+
+/* ThreadForegroundCheck finds out whether the application is in the
+	foreground, and switches profiles when that changes. The Process
+	Manager is asked, rather than relying on suspend and resume events,
+	since the application may have taken those events before Thread
+	Library gets to see them. It's called by EventPending just after it
+	calls EventAvail, which is when the application could have been
+	switched out. */
+static void ThreadForegroundCheck(void)
+{
+	ProcessSerialNumber front;
+	ProcessSerialNumber current;
+	Boolean same;
+	
+	if (gThread.process_mgr && GetFrontProcess(&front) == noErr &&
+		 GetCurrentProcess(&current) == noErr &&
+		 SameProcess(&front, &current, &same) == noErr &&
+		 same == gThread.background)
+	{
+		gThread.background = ! same;
+		ThreadProfileApply();
+	}
+}
+
+#endif /* THREAD_HEADLESS */
+
+/* ThreadTurn is called by the scheduler for a thread that's ready to run,
+	and returns true if the thread should be given this turn. A thread whose
+	class has weight w in the running scheduler (for the default scheduler,
+	in the current profile) gets w out of every THREAD_WEIGHT_MAX turns,
+	spread evenly. */
+static Boolean ThreadTurn(ThreadPtr thread)
+{
+	short weight;
+	Boolean turn;
+	
+	turn = true;
+	weight = gThread.scheduler->weight[thread->sched_class];
+	if (weight < THREAD_WEIGHT_MAX) {
+		thread->credit += weight;
+		turn = (thread->credit >= THREAD_WEIGHT_MAX);
+		if (turn)
+			thread->credit -= THREAD_WEIGHT_MAX;
+	}
+	return(turn);
+}
+
+/*	�ThreadProfileSet sets one of the two scheduling profiles, which are
+	switched automatically as the application moves between the foreground
+	(THREAD_PROFILE_FOREGROUND) and the background
+	(THREAD_PROFILE_BACKGROUND). A profile gives the preemption quantum, in
+	milliseconds, to use (see ThreadPreemptSet; zero turns preemption off),
+	the number of ticks between the scheduler's calls to EventAvail (see
+	ThreadSchedule), and the weight of each class of thread (see
+	ThreadClassSet). A weight of THREAD_WEIGHT_MAX gives threads of the
+	class every turn they're ready for, while a weight of zero stops them
+	from being scheduled at all. The profiles are reset to their defaults
+	by ThreadBeginMain. */
+void ThreadProfileSet(short which, const ThreadProfileType *profile)
+{
+	short i;
+	
+	require(ThreadValid(gThread.main));
+	require(which == THREAD_PROFILE_FOREGROUND || which == THREAD_PROFILE_BACKGROUND);
+	require(profile->quantum >= 0 && profile->event_interval >= 0);
+	gThread.error = noErr;
+	gThread.profile[which] = *profile;
+	for (i = 0; i < THREAD_CLASSES; i++) {
+		if (gThread.profile[which].weight[i] < 0)
+			gThread.profile[which].weight[i] = 0;
+		else if (gThread.profile[which].weight[i] > THREAD_WEIGHT_MAX)
+			gThread.profile[which].weight[i] = THREAD_WEIGHT_MAX;
+	}
+	if (which == gThread.background)
+		ThreadProfileApply();
+}
+
+/*	�ThreadProfileGet returns one of the two scheduling profiles. */
+void ThreadProfileGet(short which, ThreadProfileType *profile)
+{
+	require(which == THREAD_PROFILE_FOREGROUND || which == THREAD_PROFILE_BACKGROUND);
+	gThread.error = noErr;
+	*profile = gThread.profile[which];
+}
+
+/*	�ThreadForeground returns true if the application was in the foreground
+	when the scheduler last checked. It's always true without the Process
+	Manager. */
+Boolean ThreadForeground(void)
+{
+	gThread.error = noErr;
+	return(! gThread.background);
+}
+
+/*	�ThreadClassSet sets the class of the thread, which determines its
+	weight in the current scheduling profile. New threads, including the
+	main thread, are in THREAD_CLASS_NORMAL. */
+void ThreadClassSet(ThreadType tsn, short cls)
+{
+	ThreadPtr thread;
+	
+	require(0 <= cls && cls < THREAD_CLASSES);
+	thread = ThreadFromSN(tsn);
+	if (thread) {
+		thread->sched_class = cls;
+		thread->credit = 0;
+	}
+}
+
+/*	�ThreadClass returns the class of the thread. */
+short ThreadClass(ThreadType tsn)
+{
+	ThreadPtr thread;
+	
+	thread = ThreadFromSN(tsn);
+	return(thread ? thread->sched_class : THREAD_CLASS_NORMAL);
+}
+
+/*----------------------------------------------------------------------------*/
+/* Private Statistics */
+/*----------------------------------------------------------------------------*/
+
+#if THREAD_STATS
+
+/* StatsInit resets the counters for all threads and starts timing the
+	active thread. */
+static void StatsInit(void)
+{
+	memset(&gThread.stats, 0, sizeof(gThread.stats));
+	#if THREAD_STATS_TIME
+		Microseconds(&gThread.stats_start);
+	#endif
+}
+
+/* StatsAdd adds 'delta' microseconds to a run time */
+#define StatsAdd(time, delta) \
+	((void) (((time).lo += (delta)) < (delta) && (time).hi++))
+
+/* StatsOut is called by ThreadSave when the active thread is suspended,
+	and charges it for the time since it was activated. Only the low half
+	of the clock is used for the difference, which is good for over an
+	hour. */
+static void StatsOut(ThreadPtr thread)
+{
+	#if THREAD_STATS_TIME
+		UnsignedWide now;
+		unsigned long delta;
+		
+		Microseconds(&now);
+		delta = now.lo - gThread.stats_start.lo;
+		gThread.stats_start = now;
+		StatsAdd(thread->stats.run_time, delta);
+		StatsAdd(gThread.stats.run_time, delta);
+	#endif
+	thread->stats.switches_out++;
+	gThread.stats.switches_out++;
+}
+
+/* StatsIn is called by ThreadRestore when a thread is activated, and
+	records how long after its wake time it got to run. A thread woken
+	early by ThreadActivate, or by a record posted with ThreadPost, isn't
+	counted as late. */
+static void StatsIn(ThreadPtr thread)
 {
-	ThreadPtr thread;
-	jmp_buf registers;
+	ThreadTicksType late;
 	
-	/* initialize and convert serial number into a thread pointer */
-	frame->stack_top = frame->stack_bottom = frame->register_a6 = NULL;
-	thread = (tsn ? ThreadFromSN(tsn) : NULL);
-
-	/* Get the top of the thread's stack. All threads other than the main
-		thread use their own private stacks. If no thread is specified
-		then the top of the stack defaults to the top of the application's
-		stack. */
-	if (thread && thread->stack) {
-		check(thread != gThread.main);
-		frame->stack_top = thread->stack + GetPtrSize(thread->stack);
-	}
-	else {
-		check(thread == gThread.main);
-		frame->stack_top = LMGetCurStackBase();
+	thread->stats.switches_in++;
+	gThread.stats.switches_in++;
+	if (thread->wake) {
+		late = LMGetTicks() - thread->wake;
+		if (late > 0) {
+			thread->stats.late_total += late;
+			gThread.stats.late_total += late;
+			if (late > thread->stats.late_max)
+				thread->stats.late_max = late;
+			if (late > gThread.stats.late_max)
+				gThread.stats.late_max = late;
+		}
 	}
+}
 
-	if (thread == gThread.active) {
-		/* Registers a6 and a7 point into the active thread's stack so we can
-			use their current values. This is the default case if there are no
-			threads (in which case 'thread' and gThread.active are both null). */
-		check(! thread || ThreadValid(thread));
-		(void) setjmp(registers);
-		// frame->stack_bottom = (Ptr) registers[a7];
-		frame->stack_bottom = (Ptr) registers[JMP_BUF_A7_INDEX];
-		// frame->register_a6 = *(Ptr *) registers[a6];
-		frame->register_a6 = *(Ptr *) registers[JMP_BUF_A6_INDEX];
-	}
-	else {
-		/* For inactive threads, we use the values of registers a6 and a7 that
-			were saved when the thread was suspended. */
-		check(ThreadValid(thread));
-		// frame->stack_bottom = (Ptr) thread->jmpenv[a7];
-		frame->stack_bottom = (Ptr) thread->jmpenv[JMP_BUF_A7_INDEX];
-		// frame->register_a6 = (Ptr) thread->jmpenv[a6];
-		frame->register_a6 = (Ptr) thread->jmpenv[JMP_BUF_A6_INDEX];
+/* StatsYield counts a call to ThreadYield by the thread */
+static void StatsYield(ThreadPtr thread, ThreadTicksType sleep)
+{
+	thread->stats.yields++;
+	gThread.stats.yields++;
+	if (sleep) {
+		thread->stats.sleeps++;
+		gThread.stats.sleeps++;
 	}
-	ensure(! frame->register_a6 ||
-			(frame->stack_bottom <= frame->register_a6 &&
-		 	 frame->register_a6 <= frame->stack_top));
-	ensure((Ptr) 0 < frame->stack_bottom &&
-			 frame->stack_bottom <= frame->stack_top);
 }
 
+#else /* THREAD_STATS */
+
+	#define StatsInit()						((void) 0)
+	#define StatsOut(thread)				((void) 0)
+	#define StatsIn(thread)					((void) 0)
+	#define StatsYield(thread, sleep)	((void) 0)
+
+#endif /* THREAD_STATS */
+
 /*----------------------------------------------------------------------------*/
 /*	�Scheduling */
 /*----------------------------------------------------------------------------*/
@@ -901,28 +3272,91 @@ void ThreadSleepSet(ThreadType tsn, ThreadTicksType sleep)
 		ThreadSleepSetPtr(thread, sleep);
 }
 	
+#if ! THREAD_HEADLESS
+
+/* UpdatePending returns true if any visible window of the application has
+	a non-empty update region, in which case the Event Manager will return
+	an update event for the window. */
+static Boolean UpdatePending(void)
+{
+	WindowPeek window;
+	Rect *box;
+	Boolean pending;
+	
+	/* the bounding box is checked directly, since EmptyRect is a trap */
+	pending = false;
+	for (window = LMGetWindowList(); window && ! pending; window = window->nextWindow) {
+		if (window->visible && window->updateRgn) {
+			box = &(**window->updateRgn).rgnBBox;
+			pending = (box->top < box->bottom && box->left < box->right);
+		}
+	}
+	return(pending);
+}
+
 /*	EventPending returns true if an event is pending. Most events are posted
 	to the event queue, so we can determine if an event is pending simply
-	by examining the head of the event queue. Activate and update events,
-	however, are not posted to the event queue, so we need to call EventAvail
-	to detect them. Since EventAvail is a very slow trap, we make the interval
-	between calls to EventAvail as large as possible without severely
-	degrading response time. */
+	by examining the head of the event queue. Activate and update events
+	aren't posted to the event queue, but the Event Manager generates them
+	from low-memory globals and from the windows' update regions, which we
+	can also examine directly, though only as often as we call EventAvail,
+	since scanning the window list isn't free. That leaves only the events
+	the Process Manager generates (such as suspend and resume events), and
+	the time EventAvail gives to other applications, for which we must call
+	the slow EventAvail trap. An update is reported only once: if a window
+	is still waiting for its update at the next check (because the main
+	thread routed it to another thread, or chose to ignore it), neither the
+	scan nor EventAvail reports it again until the window has been updated,
+	otherwise the main thread would be activated on every yield until the
+	update was handled. The interval between checks is normally the one
+	given by the current scheduling profile. It's shortened after a check
+	finds an event, since more are likely to follow, and lengthened when
+	EventAvail itself takes a long time (as it does when other applications
+	are busy), so that at most about a quarter of the time goes to calling
+	it. */
 static Boolean EventPending(void)
 {
-	#define EVENT_PENDING_INTERVAL (15)
+	#define EVENT_PENDING_MIN (4)
+	#define EVENT_PENDING_MAX (60)
 	static ThreadTicksType nextEvent;
+	static Boolean reported;	/* update reported by the last check */
 	EventRecord event;
+	ThreadTicksType start;
+	ThreadTicksType interval;
+	Boolean update;
 	Boolean pending;
 
-	pending = false;
-	if (LMGetEventQueue()->qHead || LMGetTicks() >= nextEvent) {
-		pending = EventAvail(everyEvent, &event);
-		nextEvent = LMGetTicks() + EVENT_PENDING_INTERVAL;
+	pending = (LMGetEventQueue()->qHead != NULL);
+	if (! pending && LMGetTicks() >= nextEvent) {
+		start = LMGetTicks();
+		update = UpdatePending();
+		pending = (LMGetCurActivate() || LMGetCurDeactive() ||
+			(update && ! reported));
+		reported = update;
+		if (! pending) {
+			pending = EventAvail(update ? everyEvent & ~updateMask : everyEvent,
+				&event);
+			gThread.event_checks++;
+			ThreadForegroundCheck();
+		}
+		interval = gThread.profile[gThread.background].event_interval;
+		if (pending)
+			interval = EVENT_PENDING_MIN;
+		else if ((LMGetTicks() - start) * 4 > interval)
+			interval = (LMGetTicks() - start) * 4;
+		if (interval > EVENT_PENDING_MAX)
+			interval = EVENT_PENDING_MAX;
+		nextEvent = LMGetTicks() + interval;
 	}
 	return(pending);
 }
 
+#else /* THREAD_HEADLESS */
+
+	#define EventPending()	(false)
+
+#endif /* THREAD_HEADLESS */
+
 /* ThreadSchedulePtr is identical to ThreadSchedule, except it returns a pointer
 	to a thread instead of a thread serial number. This makes context switches
 	triggered via ThreadYield more efficient, since we already have direct
@@ -933,26 +3367,37 @@ static ThreadPtr ThreadSchedulePtr(void)
 	register ThreadPtr active;			/* active thread */
 	register ThreadPtr newthread;		/* thread to switch to */
 	register ThreadTicksType ticks;	/* current tick count */
+	register SchedulerPtr scheduler;	/* scheduler now running */
 	
 	require(ThreadValid(gThread.active));
+	if (gThread.post.qHead)
+		ThreadPostDrain();
 	gThread.error = noErr;
-	if (EventPending()) {
-		/* an event is pending, so return main thread */
-		newthread = gThread.main;
+	ticks = LMGetTicks();
+	scheduler = gThread.scheduler;
+	if (ticks >= scheduler->deadline || (! ThreadHeadless() && EventPending()))
+	{
+		/* an event is pending, or a nested scheduler's time is up, so
+			return main thread or its owner */
+		newthread = ThreadFallback();
 	}
 	else {
-		/* round-robbin search for a thread that needs to be woken up */
-		ticks = LMGetTicks();
+		/* round-robbin search for a thread of the running scheduler that
+			needs to be woken up */
 		active = gThread.active;
 		newthread = active->next;
 		check(ThreadValid(newthread));
-		while (newthread != active && newthread->wake > ticks) {
+		while (newthread != active && (newthread->scheduler != scheduler ||
+				 newthread->wake > ticks || ! ThreadTurn(newthread)))
+		{
 			newthread = newthread->next;
 			check(ThreadValid(newthread));
 		}
-		if (newthread == active && newthread->wake > ticks) {
-			/* no thread needs to be woken up, so return main thread */
-			newthread = gThread.main;
+		if (newthread == active && (newthread->scheduler != scheduler ||
+			 newthread->wake > ticks))
+		{
+			/* no thread needs to be woken up, so return main thread or owner */
+			newthread = ThreadFallback();
 		}
 	}
 	ensure(ThreadValid(newthread));
@@ -966,31 +3411,34 @@ static ThreadPtr ThreadSchedulePtr(void)
 		
 	In addition to the round-robbin scheduling shared with all threads, the
 	main thread will also be activated if any events are pending in the event
-	queue. The application can then immediately handle the events, allowing
-	the application to remain responsive to user actions such as mouse clicks.
+	queue, unless it was created with THREAD_OPTION_HEADLESS. The application
+	can then immediately handle the events, allowing the application to
+	remain responsive to user actions such as mouse clicks.
 	The main thread will also be activated if no other threads are scheduled
 	for activation, which allows the application either to continue with
 	its main processing or to call WaitNextEvent and sleep until a thread
 	needs to be activated or some other task or event needs to be handled.
+	While a nested scheduler is running, only its threads are scheduled, and
+	the thread that's running it takes the place of the main thread (see
+	ThreadSchedulerRun).
 
 	Since ThreadSchedule calls EventAvail (via EventPending), background
 	applications will continue to receive processing time, even if the main
 	thread is never activated while some compute intensive thread is executing.
 	But, since EventAvail can be a slow trap (especially when it yields the
 	processor to another application), it is only executed every few ticks.
-
-	Note: if I figure out a faster way to test for events then the call
-	to EventAvail may be removed, and background applications won't
-	get time when ThreadSchedule is called. (OSEventAvail won't work
-	since it doesn't return update or activate events.) */
+	Pending events in the event queue are detected without calling
+	EventAvail, so the main thread is activated as soon as the next thread
+	yields. Pending update and activate events are also detected without
+	calling EventAvail, but only every few ticks. */
 ThreadType ThreadSchedule(void)
 {
 	return(ThreadSN(ThreadSchedulePtr()));
 }
 
 /*	ThreadSave saves the context of the active thread. It is called before
-	a thread is suspended, but after setjmp has saved the CPU's context for
-	the thread. */
+	a thread is suspended, just before the CPU's context for the thread is
+	saved by ThreadSwitch. */
 static void ThreadSave(void)
 {
 	require(ThreadValid(gThread.active));
@@ -1004,9 +3452,12 @@ static void ThreadSave(void)
 	gThread.active->applLimit = LMGetApplLimit();
 	gThread.active->hiHeapMark = LMGetHiHeapMark();
 
+	/* charge the thread for the time it ran */
+	StatsOut(gThread.active);
+
 	/* call the application's suspend function */
 	if (gThread.active->suspend)
-		gThread.active->suspend(gThread.active->data);
+		ThreadCallBack(gThread.active->suspend, gThread.active->data);
 }
 
 /*	ThreadRestore restores the context of the active thread. It is called
@@ -1041,12 +3492,19 @@ static void ThreadRestore(void)
 	LMSetHeapEnd(thread->heapEnd);
 	LMSetApplLimit(thread->applLimit);
 	LMSetHiHeapMark(thread->hiHeapMark);
+	
+	/* give the FPU to the thread if it uses the FPU and doesn't have it */
+	if ((thread->options & THREAD_OPTION_FPU) && thread != gThread.fpu_owner)
+		ThreadFPUTake(thread);
+	
+	/* the thread starts with a fresh quantum (see ThreadPreemptSet) */
+	gThreadPreemptRequest = false;
+	thread->scheduler->stats.switches++;
+	StatsIn(thread);
 
 	/* dispose of the memory allocated for the previous thread (see ThreadEnd) */
 	if (gThread.dispose) {
-		if (gThread.dispose->stack)
-			DisposePtr(gThread.dispose->stack);
-		DisposePtr((Ptr) gThread.dispose);
+		ThreadDispose(gThread.dispose);
 		gThread.dispose = NULL;
 	}
 	
@@ -1070,53 +3528,61 @@ static void ThreadRestore(void)
 			
 	/* call the application's resume function */
 	if (thread->resume)
-		thread->resume(thread->data);
+		ThreadCallBack(thread->resume, thread->data);
 }
 
 /* ThreadActivatePtr is identical to ThreadActivate, except it takes a pointer
 	to a thread instead of a thread serial number. This makes context switches
 	triggered via ThreadYield more efficient, since we already have direct
 	access to the relavent thread pointers and so don't need to waste time
-	converting to and from thread serial numbers. */
+	converting to and from thread serial numbers.
+	
+	A thread created with THREAD_OPTION_LAZY_STACK gets its stack the first
+	time it's activated, and activating a copy-stack thread may require a
+	larger buffer for the frames being moved off the shared stack. If the
+	memory can't be allocated then the active thread continues to run, the
+	error code is set, and the thread is put to sleep for a short while so
+	that the scheduler doesn't keep retrying the allocation on every call
+	to ThreadYield. */
 static void ThreadActivatePtr(ThreadPtr thread)
 {	
 	require(ThreadValid(gThread.active));
 	require(ThreadValid(thread));
-	if (thread != gThread.active) {
-		if (setjmp(gThread.active->jmpenv) == THREAD_SAVE) {
+	if (thread != gThread.active &&
+		 ((ThreadStackPending(thread) && ! ThreadStackAllocate(thread)) ||
+		  ! ThreadCopyReserve(thread)))
+	{
+		ThreadSleepSetPtr(thread, STACK_RETRY_INTERVAL);
+	}
+	else if (thread != gThread.active) {
+	
+		/* the thread is being deactivated, so do whatever is needed to
+			save the active thread's context */
+		ThreadSave();
 		
-			/* the thread is being deactivated, so do whatever is needed to
-				save the active thread's context */
-			ThreadSave();
-			
-			/* Jump to the specified thread. This suspends the current thread
-				and returns at the setjmp statement above (unless this is the
-				first time the thread is being executed, in which case it
-				returns at the setjmp statement in ThreadBegin). The contents
-				of the stack will be correct as soon as the longjmp has
-				completed, but ThreadRestore must be called before the
-				thread can resume. */
-			gThread.active = thread;
-			longjmp(thread->jmpenv, THREAD_RUN);
-			check(false); /* doesn't return */
-		}
-		else {
-			/* the thread is being activated, so restore the thread's context */
-			ThreadRestore();
-		}
+		/* Switch to the specified thread. This suspends the current thread,
+			which resumes here when it's next activated (the first time a
+			thread is activated it starts in ThreadStart instead). The
+			contents of the stack will be correct as soon as the switch has
+			completed, but ThreadRestore must be called before the thread
+			can resume. */
+		ThreadSwitch(thread);
+		
+		/* the thread is being activated, so restore the thread's context */
+		ThreadRestore();
 	}
 	/* ensure(gThread.active == thread); */ /* can't evaluate this postcondition */
 }
 
 /*	�ThreadActivate activates the specified thread. The context switch is
-	accomplished by saving the CPU context with setjmp and then calling
-	longjmp, which jumps to the environment saved with setjmp when the thread
-	being activated was last suspended. We don't have to do any assembly
-	language glue since setjmp saved the value of the stack pointer, which
-	at the time of the call to setjmp pointed somewhere in the thread's stack.
-	The longjmp instruction will restore the value of the stack pointer and
-	will jump to the statement from which to resume the thread. Longjmp also
-	handles the saving and restoring of all registers. */
+	accomplished by saving the registers that the compiler expects to be
+	preserved across a function call, including the stack pointer, and
+	then loading the registers saved when the thread being activated was
+	last suspended. Since the saved stack pointer pointed somewhere in the
+	thread's stack, loading it switches to the thread's stack, and
+	execution continues from the point at which the thread was suspended.
+	With GCC this is done by a few instructions of assembly language;
+	otherwise setjmp and longjmp are used. */
 void ThreadActivate(ThreadType tsn)
 {
 	ThreadPtr thread;
@@ -1141,6 +3607,7 @@ void ThreadYield(ThreadTicksType sleep)
 		calculate the wakeup time to be as close as possible to the wakeup
 		time specified by the sleep parameter. */
 	ThreadSleepSetPtr(gThread.active, sleep);
+	StatsYield(gThread.active, sleep);
 	ThreadActivatePtr(ThreadSchedulePtr());
 }
 
@@ -1150,8 +3617,13 @@ void ThreadYield(ThreadTicksType sleep)
 	thread can remain inactive. The minimum of these times gives the
 	maximum amount of time till the next call to ThreadYield. The wake
 	time of the current thread is ignored, since the thread is already
-	active. You can use the returned value to determine the maximum sleep
-	value to pass to WaitNextEvent. */
+	active, as are threads that don't belong to the running scheduler.
+	You can use the returned value to determine the maximum sleep
+	value to pass to WaitNextEvent. Zero is returned if any records posted
+	with ThreadPost, or any calls for the main thread, are waiting to be
+	handled. The interval can be THREAD_TICKS_MAX while every thread waits
+	for interrupt code to post a record (as in ThreadIOWait); that's safe,
+	since ThreadPost wakes the application from WaitNextEvent. */
 ThreadTicksType ThreadYieldInterval(void)
 {
 	ThreadPtr thread;				/* for iterating through queue of threads */
@@ -1164,10 +3636,12 @@ ThreadTicksType ThreadYieldInterval(void)
 	ticks = LMGetTicks();
 	active = gThread.active;
 	thread = active->next;
-	interval = THREAD_TICKS_MAX;
+	interval = (gThread.post.qHead || gThread.call_head ? 0 : THREAD_TICKS_MAX);
 	check(ThreadValid(thread));
 	while (thread != active && interval) {
-		if (thread->wake <= ticks)
+		if (thread->scheduler != gThread.scheduler)
+			;
+		else if (thread->wake <= ticks)
 			interval = 0;
 		else if (thread->wake - ticks < interval)
 			interval = thread->wake - ticks;
@@ -1178,6 +3652,256 @@ ThreadTicksType ThreadYieldInterval(void)
 	return(interval);
 }
 
+/*	�ThreadIdle is for the event loop of the main thread of a faceless
+	application (see THREAD_OPTION_HEADLESS). It first makes any calls
+	waiting for the main thread (see ThreadMainDrain), so a loop built on
+	ThreadIdle needn't call ThreadMainDrain itself. Then, if no other thread needs to run
+	now, it calls WaitNextEvent once, sleeping until the next thread is
+	due to wake (see ThreadYieldInterval), or until a record is posted with
+	ThreadPost, which wakes the application. It returns the result of
+	WaitNextEvent so that any event, such as a high-level event, can be
+	handled. Otherwise it yields to the other threads, sets the event to a
+	null event and returns false. */
+Boolean ThreadIdle(EventRecord *event)
+{
+	ThreadTicksType interval;
+	Boolean result;
+	
+	require(gThread.active == gThread.main);
+	(void) ThreadMainDrain();
+	interval = ThreadYieldInterval();
+	if (interval > 0)
+		result = WaitNextEvent(everyEvent, event, interval, NULL);
+	else {
+		ThreadYield(0);
+		memset(event, 0, sizeof(*event));
+		event->what = nullEvent;
+		result = false;
+	}
+	return(result);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Scheduler Instances */
+/*----------------------------------------------------------------------------*/
+
+/* SchedulerFrom returns the scheduler for the given reference, where NULL
+	is the default scheduler */
+#define SchedulerFrom(scheduler)	((scheduler) ? (scheduler) : &gThread.root)
+
+/* SchedulerInit initializes a scheduler that has no threads and isn't
+	running, and whose threads get every turn they're ready for. */
+static void SchedulerInit(SchedulerPtr scheduler)
+{
+	short i;
+	
+	memset(scheduler, 0, sizeof(*scheduler));
+	scheduler->deadline = THREAD_TICKS_MAX;
+	for (i = 0; i < THREAD_CLASSES; i++)
+		scheduler->weight[i] = THREAD_WEIGHT_MAX;
+}
+
+/*	�ThreadSchedulerNew creates a scheduler for a group of threads, such as
+	those of a plug-in, that are scheduled only among themselves and only
+	while some other thread runs the scheduler with ThreadSchedulerRun. The
+	weight of each class of thread in the group is taken from the 'weight'
+	array (see ThreadProfileSet); if it's NULL, threads of every class get
+	every turn they're ready for. Threads are put into the scheduler with
+	ThreadSchedulerSet. NULL is returned if there's not enough memory. */
+ThreadSchedulerType ThreadSchedulerNew(const short *weight)
+{
+	SchedulerPtr scheduler;
+	short i;
+	
+	require(ThreadValid(gThread.main));
+	scheduler = (SchedulerPtr) NewPtr(sizeof(SchedulerStructure));
+	gThread.error = MemError();
+	if (scheduler) {
+		SchedulerInit(scheduler);
+		for (i = 0; weight && i < THREAD_CLASSES; i++) {
+			if (weight[i] < 0)
+				scheduler->weight[i] = 0;
+			else if (weight[i] < THREAD_WEIGHT_MAX)
+				scheduler->weight[i] = weight[i];
+		}
+	}
+	FailThreadError();
+	return(scheduler);
+}
+
+/*	�ThreadSchedulerDispose disposes of a scheduler created with
+	ThreadSchedulerNew. The scheduler mustn't be running, and all of its
+	threads must have ended or been moved to another scheduler. */
+void ThreadSchedulerDispose(ThreadSchedulerType scheduler)
+{
+	require(scheduler && scheduler != &gThread.root);
+	require(! scheduler->owner && scheduler->stats.threads == 0);
+	gThread.error = noErr;
+	DisposePtr((Ptr) scheduler);
+}
+
+/*	�ThreadSchedulerSet moves a thread to another scheduler, or to the
+	default scheduler if 'scheduler' is NULL. New threads belong to the
+	scheduler of the thread that created them. The main thread always
+	belongs to the default scheduler, and the active thread can't be
+	moved. */
+void ThreadSchedulerSet(ThreadType tsn, ThreadSchedulerType scheduler)
+{
+	ThreadPtr thread;
+	
+	thread = ThreadFromSN(tsn);
+	if (thread) {
+		require(thread != gThread.main && thread != gThread.active);
+		thread->scheduler->stats.threads--;
+		thread->scheduler = SchedulerFrom(scheduler);
+		thread->scheduler->stats.threads++;
+		thread->credit = 0;
+	}
+}
+
+/*	�ThreadScheduler returns the scheduler that the thread belongs to, or
+	NULL for the default scheduler. */
+ThreadSchedulerType ThreadScheduler(ThreadType tsn)
+{
+	ThreadPtr thread;
+	
+	thread = ThreadFromSN(tsn);
+	return(thread && thread->scheduler != &gThread.root ? thread->scheduler : NULL);
+}
+
+/*	�ThreadSchedulerRun lets the threads of a scheduler run for up to
+	'budget' ticks. The active thread is suspended and only threads of the
+	scheduler are activated, each time one of them yields, until the budget
+	is used up, until none of them is ready to run, or until an event or
+	a call for the main thread is pending (see ThreadSchedule); at that
+	point the active thread resumes. A thread of the scheduler can itself
+	run another scheduler, but a scheduler can't be run by two threads at
+	once, and the default scheduler can't be run at all. The thread running
+	the scheduler mustn't be ended until ThreadSchedulerRun returns. The
+	interval until one of the scheduler's threads next needs to run is
+	returned (see ThreadYieldInterval), so that the caller knows how long
+	it can wait before calling ThreadSchedulerRun again. */
+ThreadTicksType ThreadSchedulerRun(ThreadSchedulerType scheduler, ThreadTicksType budget)
+{
+	ThreadPtr thread;				/* for iterating through queue of threads */
+	ThreadTicksType start;		/* tick count when called */
+	ThreadTicksType ticks;		/* current tick count */
+	ThreadTicksType interval;	/* interval till a thread needs to run */
+	short i;
+	
+	require(ThreadValid(gThread.active));
+	require(scheduler && scheduler != &gThread.root && ! scheduler->owner);
+	require(0 <= budget && budget <= THREAD_TICKS_MAX);
+	
+	/* run the scheduler's threads until control comes back to us */
+	start = LMGetTicks();
+	scheduler->owner = gThread.active;
+	scheduler->parent = gThread.scheduler;
+	scheduler->deadline = (budget > THREAD_TICKS_MAX - start ?
+		THREAD_TICKS_MAX : start + budget);
+	gThread.scheduler = scheduler;
+	ThreadYield(0);
+	gThread.scheduler = scheduler->parent;
+	scheduler->owner = NULL;
+	scheduler->parent = NULL;
+	scheduler->deadline = THREAD_TICKS_MAX;
+	ticks = LMGetTicks();
+	scheduler->stats.runs++;
+	scheduler->stats.ticks += ticks - start;
+	
+	/* find out when the scheduler's threads next need to run */
+	gThread.error = noErr;
+	interval = THREAD_TICKS_MAX;
+	thread = gThread.queue.head;
+	for (i = 0; i < gThread.queue.nelem && interval; i++, thread = thread->next) {
+		check(ThreadValid(thread));
+		if (thread->scheduler != scheduler)
+			;
+		else if (thread->wake <= ticks)
+			interval = 0;
+		else if (thread->wake - ticks < interval)
+			interval = thread->wake - ticks;
+	}
+	ensure(interval >= 0);
+	return(interval);
+}
+
+/*	�ThreadSchedulerStats returns the counters kept by a scheduler, or by
+	the default scheduler if 'scheduler' is NULL: the number of threads in
+	it, the number of times it was run, the number of times one of its
+	threads was activated, and the ticks it spent running. */
+void ThreadSchedulerStats(ThreadSchedulerType scheduler, ThreadSchedulerStatsType *stats)
+{
+	require(stats != NULL);
+	gThread.error = noErr;
+	*stats = SchedulerFrom(scheduler)->stats;
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Statistics */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadStats takes a snapshot of the counters kept for a thread, or, if
+	'tsn' is THREAD_NONE, of the totals for all threads since ThreadBeginMain
+	was called (including threads that have ended). The counters are the
+	number of times the thread was activated and suspended, the time it
+	ran in microseconds, the number of calls to ThreadYield and how many of
+	them asked to sleep, and the total and longest time in ticks between
+	the thread's wake time and its activation. The stack peak is measured
+	when the snapshot is taken (see ThreadStackPeak); the total gives the
+	largest peak of any thread that still exists. The counters are updated
+	on every context switch, so they're kept even when debug code is
+	disabled, unless Thread Library was compiled with THREAD_STATS defined
+	as 0, in which case they're all zero. */
+void ThreadStats(ThreadType tsn, ThreadStatsType *stats)
+{
+	ThreadPtr thread;
+	size_t peak;
+	short i;
+	
+	require(stats != NULL);
+	if (tsn != THREAD_NONE) {
+		thread = ThreadFromSN(tsn);
+		if (thread) {
+			*stats = thread->stats;
+			stats->stack_peak = ThreadStackPeakPtr(thread);
+		}
+		else
+			memset(stats, 0, sizeof(*stats));
+	}
+	else {
+		gThread.error = noErr;
+		*stats = gThread.stats;
+		thread = gThread.queue.head;
+		for (i = 0; i < gThread.queue.nelem; i++, thread = thread->next) {
+			peak = ThreadStackPeakPtr(thread);
+			if (peak > stats->stack_peak)
+				stats->stack_peak = peak;
+		}
+	}
+}
+
+/*	�ThreadStatsReset clears the counters kept for a thread, or for all
+	threads and the totals if 'tsn' is THREAD_NONE. */
+void ThreadStatsReset(ThreadType tsn)
+{
+	ThreadPtr thread;
+	short i;
+	
+	if (tsn != THREAD_NONE) {
+		thread = ThreadFromSN(tsn);
+		if (thread)
+			memset(&thread->stats, 0, sizeof(thread->stats));
+	}
+	else {
+		gThread.error = noErr;
+		memset(&gThread.stats, 0, sizeof(gThread.stats));
+		thread = gThread.queue.head;
+		for (i = 0; i < gThread.queue.nelem; i++, thread = thread->next)
+			memset(&thread->stats, 0, sizeof(thread->stats));
+	}
+}
+
 /*----------------------------------------------------------------------------*/
 /*	�Thread Creation and Destruction */
 /*----------------------------------------------------------------------------*/
@@ -1190,6 +3914,16 @@ static void ThreadEndPtr(ThreadPtr thread)
 	
 	require(ThreadValid(thread));
 
+	/* release the thread's thread-local storage */
+	ThreadKeysEnd(thread);
+	
+	/* free records of calls the thread was waiting for */
+	MainCallsForget(thread);
+
+	/* the frames of a thread that's ending needn't be saved */
+	if (thread == gThread.shared_owner)
+		gThread.shared_owner = NULL;
+
 	newthread = NULL;
 	if (thread == gThread.main) {
 		
@@ -1199,11 +3933,33 @@ static void ThreadEndPtr(ThreadPtr thread)
 		/* clear globals */
 		check(gThread.active == thread);
 		check(gThread.queue.nelem == 1);
+		
+		/* leave the main thread's FPU context in the FPU */
+		if ((thread->options & THREAD_OPTION_FPU) && thread != gThread.fpu_owner)
+			ThreadFPUTake(thread);
+		
 		gThread.main = gThread.active = NULL;
 		
 		/* remove our stack sniffer VBL task */
 		StackSnifferRemove();
 		
+		/* dispose of the stack shared by copy-stack threads */
+		ThreadCopyDispose();
+		
+		/* dispose of the reserved region */
+		RegionDispose();
+		
+		/* put back the previous grow-zone function */
+		ThreadGrowZoneRemove();
+		
+		/* stop asking for preemption */
+		ThreadPreemptRemove();
+		
+		/* forget about records that were posted but never handled */
+		gThread.wake_process = false;
+		while (ThreadPostTake())
+			;
+		
 	}
 	else if (thread == gThread.active) {
 	
@@ -1212,7 +3968,18 @@ static void ThreadEndPtr(ThreadPtr thread)
 			thread is the active thread. */
 		newthread = ThreadSchedulePtr();
 		if (newthread == gThread.active)
-			newthread = gThread.main;
+			newthread = ThreadFallback();
+		
+		/* If the memory needed to activate the next thread can't be
+			allocated now, then activate the main thread (or the thread
+			running the current scheduler) instead, since it's always
+			able to run. */
+		if ((ThreadStackPending(newthread) && ! ThreadStackAllocate(newthread)) ||
+			 ! ThreadCopyReserve(newthread))
+		{
+			ThreadSleepSetPtr(newthread, STACK_RETRY_INTERVAL);
+			newthread = ThreadFallback();
+		}
 			
 	}
 	
@@ -1220,6 +3987,7 @@ static void ThreadEndPtr(ThreadPtr thread)
 	
 	/* remove thread from queue */
 	ThreadDequeue(&gThread.queue, thread);
+	thread->scheduler->stats.threads--;
 	
 	if (thread == gThread.active && newthread) {
 	
@@ -1233,15 +4001,13 @@ static void ThreadEndPtr(ThreadPtr thread)
 
 		/* activate the next thread (we don't call ThreadActivate since
 			there's no need to save the now-defunct thread's state) */
-		gThread.active = newthread;
-		longjmp(newthread->jmpenv, THREAD_RUN);
+		ThreadJump(newthread);
 		check(false); /* doesn't return */
 	}
 	else {
-		/* dispose of the memory allocated for the thread */
-		if (thread->stack)
-			DisposePtr(thread->stack);
-		DisposePtr((Ptr) thread);
+		/* dispose of the memory allocated for the thread; a thread whose
+			stack was never allocated is disposed of here too */
+		ThreadDispose(thread);
 	}
 }
 
@@ -1291,10 +4057,25 @@ void ThreadEnd(ThreadType tsn)
 */
 ThreadType ThreadBeginMain(ThreadProcType suspend, ThreadProcType resume,
 	void *data)
+{
+	return(ThreadBeginMainOptions(suspend, resume, data, THREAD_OPTION_NONE));
+}
+
+/*	�ThreadBeginMainOptions is identical to ThreadBeginMain, but also takes a
+	set of options. The only option for the main thread is
+	THREAD_OPTION_HEADLESS, for a faceless application that never presents
+	a user interface. The scheduler then never looks for events, so it
+	doesn't call EventAvail, and the main thread is scheduled just like any
+	other thread; it's still activated when no other thread needs to run,
+	at which point it should call ThreadIdle. */
+ThreadType ThreadBeginMainOptions(ThreadProcType suspend, ThreadProcType resume,
+	void *data, ThreadOptionsType options)
 {
 	ThreadPtr thread = NULL; /* the new thread */
+	long attr;							/* Gestalt attributes */
 
 	require(! gThread.main);
+	require(! (options & ~THREAD_OPTION_HEADLESS));
 
 	/* This is always the first routine called for the thread library
 		(except, perhaps, for ThreadStackFrame, but that's a "private"
@@ -1305,10 +4086,35 @@ ThreadType ThreadBeginMain(ThreadProcType suspend, ThreadProcType resume,
 		
 	gThread.error = noErr;
 
-	/* allocate thread structure */
-	if (MemAvailable(sizeof(ThreadStructure))) {
-		thread = (ThreadPtr) NewPtrClear(sizeof(ThreadStructure));
-		gThread.error = MemError();
+	/* Temporary memory is only used if its handles can be treated like
+		any other handle, as they can from System 7 on. */
+	gThread.temp_memory = (Gestalt(gestaltOSAttr, &attr) == noErr &&
+		(attr & (1 << gestaltRealTempMemory)) != 0);
+	
+	/* the Process Manager tells us when we're in the background */
+	gThread.process_mgr = (Gestalt(gestaltOSAttr, &attr) == noErr &&
+		(attr & (1 << gestaltLaunchControl)) != 0);
+	
+	/* ThreadPost wakes the application if it's sleeping in WaitNextEvent */
+	gThread.wake_process = (gThread.process_mgr &&
+		GetCurrentProcess(&gThread.process) == noErr);
+	SchedulerInit(&gThread.root);
+	gThread.scheduler = &gThread.root;
+	ThreadProfileDefaults();
+	ThreadProfileApply();
+	gThread.busy = 0;
+	gThread.headless = (THREAD_HEADLESS || (options & THREAD_OPTION_HEADLESS) != 0);
+	
+	/* allocate thread structure, the buffer for the main thread's FPU
+		context if there's an FPU, and the reserved region if one was
+		requested with ThreadReserveSet */
+	thread = ThreadStructureNew(THREAD_OPTION_NONE);
+	if (thread)
+		ThreadFPUInit(thread);
+	if (thread && (! ThreadFPUAllocate(thread) || ! RegionInit())) {
+		ThreadFPUDispose(thread);
+		ThreadStructureDispose(thread);
+		thread = NULL;
 	}
 	if (thread) {
 	
@@ -1323,17 +4129,33 @@ ThreadType ThreadBeginMain(ThreadProcType suspend, ThreadProcType resume,
 		thread->applLimit = LMGetApplLimit();
 		thread->hiHeapMark = LMGetHiHeapMark();
 		
+		/* Paint the unused part of the application's stack, staying well
+			clear of the stack pointer so that StackPaint doesn't paint over
+			its own stack frame. */
+		#define STACK_PAINT_MARGIN (256)
+		StackPaint(thread->applLimit, (Ptr) &thread - STACK_PAINT_MARGIN);
+		
 		/* make this thread the active and main thread */
 		gThread.active = thread;
 		gThread.main = thread;
 		
+		/* no calls are waiting for the main thread yet */
+		MainCallsInit();
+		gThread.event_checks = 0;
+		StatsInit();
+		
 		/* now that the thread is ready to use, append it to the queue of threads
 			so that it can be scheduled for execution */
+		thread->scheduler = &gThread.root;
+		thread->scheduler->stats.threads++;
 		ThreadEnqueue(&gThread.queue, thread);
 		
 		/* install and activate stack sniffer VBL task */
 		StackSnifferInstall();
 		StackSnifferResume();
+		
+		/* release unused memory when the heap is full */
+		ThreadGrowZoneInstall();
 	}
 	FailThreadError();
 	ensure(thread ? ThreadValid(thread) && ! ThreadError() : ThreadError());
@@ -1342,6 +4164,25 @@ ThreadType ThreadBeginMain(ThreadProcType suspend, ThreadProcType resume,
 	return(ThreadSN(thread));
 }
 
+/* ThreadStart is the first function executed in every thread other than
+	the main thread; it's called on the thread's own stack when the thread
+	is first activated. Tracing function calls on the stack stops at
+	ThreadStart, ensuring that the thread library segment is not unloaded
+	by my automatic segment unloading routines. */
+static THREAD_NOINLINE void ThreadStart(void)
+{
+	/* set up the thread's context */
+	ThreadRestore();
+	
+	/* call the thread's entry point */
+	gThread.active->entry(gThread.active->data);
+	
+	/* dispose of the thread and switch to the next scheduled thread */
+	ThreadEndPtr(gThread.active);
+
+	check(false); /* never returns */
+}
+
 /*	�ThreadBegin creates a new thread and returns the thread's serial number.
 	You must create the main thread with ThreadBeginMain before you can call
 	ThreadBegin. The 'entry' parameter is a pointer to a function that is
@@ -1382,6 +4223,17 @@ ThreadType ThreadBeginMain(ThreadProcType suspend, ThreadProcType resume,
 ThreadType ThreadBegin(ThreadProcType entry,
 	ThreadProcType suspend, ThreadProcType resume,
 	void *data, size_t stack_size)
+{
+	return(ThreadBeginOptions(entry, suspend, resume, data, stack_size,
+		THREAD_OPTION_NONE));
+}
+
+/* ThreadBeginPtr is identical to ThreadBeginOptions (see below), except it
+	returns a pointer to the new thread, or NULL with the error code set,
+	instead of failing. */
+static ThreadPtr ThreadBeginPtr(ThreadProcType entry,
+	ThreadProcType suspend, ThreadProcType resume,
+	void *data, size_t stack_size, ThreadOptionsType options)
 {
 	ThreadPtr thread = NULL; /* the new thread */
 	
@@ -1392,10 +4244,7 @@ ThreadType ThreadBegin(ThreadProcType entry,
 	gThread.error = noErr;
 
 	/* allocate thread structure */
-	if (MemAvailable(sizeof(ThreadStructure))) {
-		thread = (ThreadPtr) NewPtrClear(sizeof(ThreadStructure));
-		gThread.error = MemError();
-	}
+	thread = ThreadStructureNew(options);
 	if (thread) {
 	
 		/* initialize thread structure */
@@ -1403,80 +4252,24 @@ ThreadType ThreadBegin(ThreadProcType entry,
 		thread->suspend = suspend;
 		thread->resume = resume;
 		thread->data = data;
+		thread->options = options;
+		if (! stack_size && (options & THREAD_OPTION_STACK_AUTOSIZE))
+			stack_size = ThreadStackRecommended(entry);
+		thread->stack_size = (stack_size ? stack_size : ThreadStackDefault());
+		thread->arena_size = gThread.arena_default;
 		thread->sn = ++gThread.lastsn;
-			
-		/* The main thread uses the application's regular stack, while
-			nonrelocatable blocks are allocated to contain the stacks of
-			all other threads. Since the stack persists until the thread
-			that created it terminates, you can create any object you
-			require on a thread's stack, including window records and parameter
-			blocks. The main advantage of using separate stacks, however,
-			is the speed of context switches. A context switch involves
-			only a call to longjmp; no time consuming saving and restoring
-			of stacks is necessary. */
-		if (! stack_size)
-			stack_size = ThreadStackDefault();
-		if (MemAvailable(stack_size)) {
-			thread->stack = NewPtr(stack_size);
-			gThread.error = MemError();
-		}
-		if (thread->stack) {
-		
-			/* Since all threads other than the main thread use stacks
-				allocated in the application's heap, we need to disable the
-				stack sniffer VBL task by setting the low-memory global
-				variable StkLowPt to 0. Otherwise, the stack sniffer would
-				generate system error #28. */
-			LMSetStkLowPt(NULL);
-			
-			/* To help the stack sniffer catch stack overrun, we write a
-				long-word at the bottom of the thread's stack. */
-			*(long *) thread->stack = STACK_SNIFFER_SENTINEL;
-			
-			/* Certain low-memory globals divide the stack and heap.
-				We change these globals when a thread other than the
-				main thread is activated so that certain OS traps will
-				work correctly. */
-			thread->heapEnd = thread->stack;
-			thread->applLimit = thread->stack;
-			thread->hiHeapMark = thread->stack;
-
-			/* Set up the new thread's jump environment so that we'll jump
-				here when the thread is first activated. */
-			if (setjmp(thread->jmpenv) == THREAD_RUN) {
-	
-				/* We're now executing the *new* thread (I know, it doesn't
-					look like it, but it's all due to the magic [hell?] of
-					non-local gotos and global variables). At this point,
-					the stack is empty, so we can't access any local variables.
-					All subsequent executions of the thread will go through the
-					setjmp call in ThreadActivate. */
-	
-				/* set up the thread's context */
-				ThreadRestore();
-				
-				/* call the thread's entry point */
-				gThread.active->entry(gThread.active->data);
-					
-				/* dispose of the thread and switch to the next scheduled thread */
-				ThreadEndPtr(gThread.active);
-
-				check(false); /* never returns */
-			}
-	
-			/* Munge the registers in the jump environment so that we start from
-				the top of the thread's stack, and so that tracing function calls
-				on the stack will stop when it reaches the first function executed
-				in the new thread (which will always be ThreadBegin, ensuring that
-				the thread library segment is not unloaded by my automatic segment
-				unloading routines). */
-			// thread->jmpenv[a7] = (long) thread->stack + stack_size;
-			thread->jmpenv[JMP_BUF_A7_INDEX] = (long) thread->stack + stack_size;
-			// thread->jmpenv[a6] = 0;
-			thread->jmpenv[JMP_BUF_A6_INDEX] = 0;
+
+		/* The thread's context is set up when its stack is allocated, so
+			that it starts in ThreadStart when it's first activated. */
+		if (ThreadFPUAllocate(thread) &&
+			 ((options & THREAD_OPTION_LAZY_STACK) || ThreadStackAllocate(thread)))
+		{
 	
 			/* now that the thread is ready to use, append it to the queue of
-				threads so that it can be scheduled for execution */
+				threads so that it can be scheduled for execution; it belongs
+				to the same scheduler as the thread creating it */
+			thread->scheduler = gThread.active->scheduler;
+			thread->scheduler->stats.threads++;
 			ThreadEnqueue(&gThread.queue, thread);
 			
 			/* We've now successfully created a new thread and set things up so
@@ -1486,11 +4279,210 @@ ThreadType ThreadBegin(ThreadProcType entry,
 				start executing until it has been scheduled to start. */
 		}
 		else {
-			DisposePtr((Ptr) thread);
+			ThreadFPUDispose(thread);
+			ThreadStructureDispose(thread);
 			thread = NULL;
 		}
 	}
+	return(thread);
+}
+
+/*	�ThreadBeginOptions is identical to ThreadBegin, but also takes a set
+	of options that change how the thread is created and run. The options
+	are:
+	
+	- THREAD_OPTION_LAZY_STACK: The thread's stack isn't allocated until
+	the thread is first activated. This keeps peak memory use down when
+	many threads are created up front but only a few of them run at once.
+	If there isn't enough memory for the stack when the thread is scheduled
+	to run, then the thread simply isn't activated; ThreadError returns the
+	memory error and activation is retried a little later. As with all other
+	threads, the stack is disposed of as soon as the thread ends, either
+	immediately if another thread calls ThreadEnd, or otherwise when the
+	next thread is activated, since a thread can't dispose of the stack it's
+	running on.
+	
+	- THREAD_OPTION_COPY_STACK: The thread runs on a stack shared by all
+	copy-stack threads instead of on a stack of its own. When some other
+	copy-stack thread needs the shared stack, the used part of the thread's
+	stack is copied into a buffer just large enough to hold it, and is copied
+	back when the thread is next activated. This makes context switches
+	between copy-stack threads slower, but uses much less memory when there
+	are many mostly idle threads. The shared stack is allocated when the
+	first copy-stack thread is created, and is as large as the stack size
+	requested for that thread. Since the thread's frames are moved, the
+	address of a local variable mustn't be given to another thread, or to
+	an interrupt routine (such as an I/O completion routine), while the
+	thread is suspended.
+	
+	- THREAD_OPTION_STACK_AUTOSIZE: If 'stack_size' is zero, then the size
+	returned by ThreadStackRecommended for the thread's entry point is used,
+	or the default stack size if no recommendation can be made yet.
+	
+	- THREAD_OPTION_TEMP_MEMORY: The thread's stack is allocated from
+	temporary memory if possible, leaving the application's heap free for
+	other uses. Ignored for copy-stack threads.
+	
+	- THREAD_OPTION_RESERVED: The thread's structure and stack are allocated
+	from the region set aside with ThreadReserveSet if there's room. If
+	combined with THREAD_OPTION_TEMP_MEMORY, temporary memory is tried
+	first. Only the structure is affected for copy-stack threads.
+	
+	- THREAD_OPTION_FPU: The thread uses the floating point unit, so the
+	FPU's registers are saved and restored for it (see ThreadFPUUse).
+	Ignored if there's no FPU. */
+ThreadType ThreadBeginOptions(ThreadProcType entry,
+	ThreadProcType suspend, ThreadProcType resume,
+	void *data, size_t stack_size, ThreadOptionsType options)
+{
+	ThreadPtr thread; /* the new thread */
+	
+	thread = ThreadBeginPtr(entry, suspend, resume, data, stack_size, options);
 	FailThreadError();
 	ensure(thread ? ThreadValid(thread) && ! ThreadError() : ThreadError());
 	return(ThreadSN(thread));
 }
+
+/*	�ThreadBeginBatch creates 'count' threads at once, all with the same entry
+	point, call-backs, stack size and options, and returns their serial
+	numbers in the 'threads' array. The i'th thread is passed data[i], or
+	NULL if 'data' is NULL. Either every thread is created and true is
+	returned, or none is and false is returned with the error code set.
+	
+	The structures and stacks of all the threads are allocated in a single
+	block, which is disposed of once every thread in the batch has ended;
+	the contexts are all copied from one set up for the first thread, and
+	the threads are added to the queue of threads in one step. This makes
+	starting a fleet of workers much cheaper than calling ThreadBeginOptions
+	for each of them. THREAD_OPTION_LAZY_STACK and THREAD_OPTION_COPY_STACK
+	can't be used, since every thread gets its stack in the one block; with
+	THREAD_OPTION_TEMP_MEMORY or THREAD_OPTION_RESERVED the whole block comes
+	from temporary memory or the reserved region. If Thread Library was
+	compiled with THREAD_STATIC_THREADS the threads are simply created one
+	at a time, though still all or none. */
+Boolean ThreadBeginBatch(ThreadProcType entry,
+	ThreadProcType suspend, ThreadProcType resume,
+	void **data, size_t stack_size, ThreadOptionsType options,
+	short count, ThreadType *threads)
+{
+	#if THREAD_STATIC_THREADS
+	
+		ThreadPtr thread;				/* thread just created */
+		OSErr err;						/* error creating thread */
+		short i, j;
+		
+		require(count > 0 && threads != NULL);
+		require(! (options & (THREAD_OPTION_LAZY_STACK | THREAD_OPTION_COPY_STACK)));
+		for (i = 0; i < count; i++) {
+			thread = ThreadBeginPtr(entry, suspend, resume,
+				data ? data[i] : NULL, stack_size, options);
+			if (! thread) {
+				err = gThread.error;
+				for (j = 0; j < i; j++)
+					ThreadEndPtr(ThreadFromSN(threads[j]));
+				gThread.error = err;
+				break;
+			}
+			threads[i] = thread->sn;
+		}
+		
+	#else /* THREAD_STATIC_THREADS */
+	
+		BatchHeaderPtr batch;		/* block holding threads and stacks */
+		Handle handle;					/* temporary memory holding block */
+		ThreadContextType context;	/* context of first thread */
+		ThreadPtr first;				/* first thread in batch */
+		ThreadPtr thread;				/* thread being set up */
+		size_t structure_size;		/* size of a thread's structure in block */
+		size_t stride;					/* size of a thread's stack and arena */
+		size_t arena_size;			/* size of a thread's arena */
+		short i, j;
+		
+		require(ThreadValid(gThread.main));
+		require(entry != NULL);
+		require(0 <= stack_size);
+		require(count > 0 && threads != NULL);
+		require(! (options & (THREAD_OPTION_LAZY_STACK | THREAD_OPTION_COPY_STACK)));
+		
+		gThread.error = noErr;
+		if (! stack_size && (options & THREAD_OPTION_STACK_AUTOSIZE))
+			stack_size = ThreadStackRecommended(entry);
+		if (! stack_size)
+			stack_size = ThreadStackDefault();
+		arena_size = gThread.arena_default;
+		structure_size = BatchAlign(sizeof(ThreadStructure));
+		stride = BatchAlign(stack_size + arena_size);
+		
+		/* allocate one block for all of the structures, then all of the stacks */
+		batch = (BatchHeaderPtr) ThreadMemNew(BatchAlign(sizeof(BatchHeaderType)) +
+			count * (structure_size + stride), options, &handle);
+		if (batch) {
+			batch->live = count;
+			batch->handle = handle;
+			first = (ThreadPtr) ((Ptr) batch + BatchAlign(sizeof(BatchHeaderType)));
+			
+			/* initialize the structures and stacks, linking the threads to
+				each other */
+			thread = first;
+			for (i = 0; i < count; i++) {
+				memset(thread, 0, sizeof(ThreadStructure));
+				thread->magic = THREAD_MAGIC;
+				thread->canary = THREAD_CANARY;
+				thread->entry = entry;
+				thread->suspend = suspend;
+				thread->resume = resume;
+				thread->data = (data ? data[i] : NULL);
+				thread->options = options;
+				thread->batch = batch;
+				thread->stack_handle = handle;
+				thread->stack = (Ptr) first + count * structure_size + i * stride;
+				thread->stack_size = stack_size;
+				thread->arena_size = arena_size;
+				if (arena_size)
+					thread->arena = thread->stack + stack_size;
+				ThreadStackPrepare(thread);
+				if (! ThreadFPUAllocate(thread))
+					break;
+				if (i > 0) {
+					thread->prev = (ThreadPtr) ((Ptr) thread - structure_size);
+					thread->prev->next = thread;
+				}
+				thread = (ThreadPtr) ((Ptr) thread + structure_size);
+			}
+			
+			/* if an FPU context couldn't be allocated, give everything back */
+			if (i < count) {
+				for (j = 0, thread = first; j <= i; j++) {
+					ThreadFPUDispose(thread);
+					thread = (ThreadPtr) ((Ptr) thread + structure_size);
+				}
+				ThreadMemDispose((Ptr) batch, handle);
+				batch = NULL;
+			}
+		}
+		if (batch) {
+		
+			/* Every thread starts in ThreadStart at the top of its own stack,
+				so each context is a copy of the first thread's, moved up by
+				the distance between their stacks. */
+			ThreadContextStart(&context, first->stack + stack_size, ThreadStart);
+			thread = first;
+			for (i = 0; i < count; i++) {
+				thread->context = context;
+				ThreadContextSP(&thread->context) += i * stride;
+				thread->sn = ++gThread.lastsn;
+				thread->scheduler = gThread.active->scheduler;
+				threads[i] = thread->sn;
+				thread = (ThreadPtr) ((Ptr) thread + structure_size);
+			}
+			first->scheduler->stats.threads += count;
+			ThreadSplice(&gThread.queue, first,
+				(ThreadPtr) ((Ptr) first + (count - 1) * structure_size), count);
+		}
+		
+	#endif /* THREAD_STATIC_THREADS */
+	
+	FailThreadError();
+	ensure(ThreadError() || ThreadValid(ThreadFromSN(threads[count - 1])));
+	return(! ThreadError());
+}
@@ -5,6 +5,7 @@
 
 #include <limits.h>
 #include <stddef.h>
+#include <Events.h>
 
 #define THREAD_VERSION			(1)			/* version of thread library */
 #define THREAD_NONE				(0)			/* serial number of an invalid thread */
@@ -19,9 +20,64 @@ typedef long ThreadStatusType;
 enum {
 	THREAD_STATUS_NORMAL,						/* status of a new thread */
 	THREAD_STATUS_QUIT,							/* the application is quitting */
+	THREAD_STATUS_LOW_MEMORY,					/* memory is low, release caches */
 	THREAD_STATUS_RESERVED = 1023				/* last reserved status */
 };
 
+/* Thread options. Options are passed to ThreadBeginOptions when a thread
+	is created, and may be combined. ThreadBegin creates threads with
+	THREAD_OPTION_NONE. */
+typedef long ThreadOptionsType;
+enum {
+	THREAD_OPTION_NONE			= 0x0000,	/* default options */
+	THREAD_OPTION_LAZY_STACK	= 0x0001,	/* allocate stack when first activated */
+	THREAD_OPTION_COPY_STACK	= 0x0002,	/* run on shared stack, save used part */
+	THREAD_OPTION_STACK_AUTOSIZE	= 0x0004,	/* use recommended stack size */
+	THREAD_OPTION_TEMP_MEMORY	= 0x0008,	/* stack from temporary memory */
+	THREAD_OPTION_RESERVED		= 0x0010,	/* stack and thread from reserved region */
+	THREAD_OPTION_FPU				= 0x0020,	/* thread uses the floating point unit */
+	THREAD_OPTION_HEADLESS		= 0x0040		/* main thread doesn't handle events */
+};
+
+/* Thread classes. A thread's class is set with ThreadClassSet, and
+	determines how often the thread is scheduled according to the weights
+	in the current scheduling profile. */
+enum {
+	THREAD_CLASS_NORMAL,							/* class of a new thread */
+	THREAD_CLASS_INTERACTIVE,					/* thread the user is waiting for */
+	THREAD_CLASS_BULK,							/* thread doing background work */
+	THREAD_CLASSES									/* number of classes */
+};
+
+/* weight of a class that gets every turn */
+#define THREAD_WEIGHT_MAX		(8)
+
+/* The two scheduling profiles; Thread Library switches between them as
+	the application moves between the foreground and the background. */
+enum {
+	THREAD_PROFILE_FOREGROUND,					/* used while in the foreground */
+	THREAD_PROFILE_BACKGROUND					/* used while in the background */
+};
+
+/* scheduling profile, as passed to ThreadProfileSet */
+typedef struct {
+	long quantum;									/* preemption quantum in ms, or 0 */
+	long event_interval;							/* ticks between calls to EventAvail */
+	short weight[THREAD_CLASSES];				/* turns out of THREAD_WEIGHT_MAX */
+} ThreadProfileType, *ThreadProfilePtr;
+
+/* scheduler for a group of threads, as returned by ThreadSchedulerNew;
+	NULL refers to the default scheduler */
+typedef struct SchedulerStructure *ThreadSchedulerType;
+
+/* counters kept by a scheduler, as returned by ThreadSchedulerStats */
+typedef struct {
+	short threads;									/* threads belonging to scheduler */
+	long runs;										/* calls to ThreadSchedulerRun */
+	long switches;									/* activations of its threads */
+	long ticks;										/* ticks spent in ThreadSchedulerRun */
+} ThreadSchedulerStatsType;
+
 /* error numbers (also defined in <Threads.h>) */
 // #ifndef __THREADS__
 // 	enum {
@@ -34,6 +90,22 @@ enum {
 typedef long ThreadType;						/* thread reference */
 typedef long ThreadTicksType;					/* clock ticks */
 typedef void (*ThreadProcType)(void *data); /* thread call-back function */
+typedef short ThreadKeyType;					/* thread-local storage key */
+
+#define THREAD_KEY_NONE		(-1)			/* invalid thread-local storage key */
+
+/* counters kept for a thread, or for all threads, as returned by
+	ThreadStats */
+typedef struct {
+	long switches_in;								/* times activated */
+	long switches_out;							/* times suspended */
+	UnsignedWide run_time;						/* microseconds spent running */
+	long yields;									/* calls to ThreadYield */
+	long sleeps;									/* calls asking to sleep */
+	ThreadTicksType late_total;				/* total ticks activated late */
+	ThreadTicksType late_max;					/* most ticks activated late */
+	size_t stack_peak;							/* most stack used */
+} ThreadStatsType;
 
 /* The type ThreadSNType is a synonym for the type ThreadType.
 	Applications should refer to threads using variables of type
@@ -44,6 +116,14 @@ typedef void (*ThreadProcType)(void *data); /* thread call-back function */
 #define THREAD_SN_NONE	THREAD_NONE
 typedef ThreadType ThreadSNType;
 
+/* stack usage of a thread, as returned by ThreadStackReport */
+typedef struct {
+	ThreadType thread;							/* the thread */
+	ThreadProcType entry;						/* thread's entry point */
+	size_t size;									/* size of thread's stack */
+	size_t peak;									/* most stack space used by thread */
+} ThreadStackUsageType;
+
 /* information needed in "SegmentLib.c" for automatic segment unloading */
 typedef struct {
 	Ptr stack_top;									/* highest address in thread's stack */
@@ -51,6 +131,17 @@ typedef struct {
 	Ptr register_a6;								/* value of thread's register a6 */
 } ThreadStackFrameType;
 
+/* record posted from interrupt code with ThreadPost; the first two fields
+	are used by the Operating System's queue routines */
+typedef struct ThreadPostRec {
+	struct ThreadPostRec *qLink;				/* next record in queue */
+	short qType;									/* unused */
+	volatile Boolean posted;					/* true while record is queued */
+	ThreadType thread;							/* thread to wake up, or THREAD_NONE */
+	ThreadProcType proc;							/* function to call, or NULL */
+	void *data;										/* parameter to pass to 'proc' */
+} ThreadPostRec, *ThreadPostPtr;
+
 OSErr ThreadError(void);
 
 short ThreadCount(void);
@@ -65,21 +156,84 @@ void ThreadStatusSet(ThreadType thread, ThreadStatusType status);
 void *ThreadData(ThreadType thread);
 void ThreadDataSet(ThreadType thread, void *data);
 
+ThreadKeyType ThreadKeyNew(ThreadProcType destructor);
+void ThreadKeyDispose(ThreadKeyType key);
+void *ThreadKeyGet(ThreadKeyType key);
+void ThreadKeySet(ThreadKeyType key, void *value);
+
+void ThreadReserveSet(size_t size);
+long ThreadMemoryRecovered(void);
+
+size_t ThreadArenaDefault(void);
+void ThreadArenaDefaultSet(size_t size);
+void *ThreadAlloc(size_t size);
+void ThreadFree(void *block);
+void ThreadArenaReset(void);
+
 size_t ThreadStackMinimum(void);
 size_t ThreadStackDefault(void);
 size_t ThreadStackSpace(ThreadType thread);
+size_t ThreadStackPeak(ThreadType thread);
+short ThreadStackReport(ThreadStackUsageType *usage, short count);
+size_t ThreadStackRecommended(ThreadProcType entry);
 
 void ThreadStackFrame(ThreadType thread, ThreadStackFrameType *frame);
 
+void ThreadFPUUse(ThreadType thread);
+
 void ThreadSleepSet(ThreadType thread, ThreadTicksType sleep);
 ThreadType ThreadSchedule(void);
 void ThreadActivate(ThreadType thread);
 void ThreadYield(ThreadTicksType sleep);
 ThreadTicksType ThreadYieldInterval(void);
+Boolean ThreadIdle(EventRecord *event);
+
+void ThreadPreemptSet(long quantum);
+long ThreadPreempt(void);
+void ThreadCheck(void);
+
+void ThreadPost(ThreadPostPtr post);
+
+long ThreadEventChecks(void);
+
+void ThreadStats(ThreadType thread, ThreadStatsType *stats);
+void ThreadStatsReset(ThreadType thread);
+
+void ThreadProfileSet(short which, const ThreadProfileType *profile);
+void ThreadProfileGet(short which, ThreadProfileType *profile);
+Boolean ThreadForeground(void);
+void ThreadClassSet(ThreadType thread, short cls);
+short ThreadClass(ThreadType thread);
+
+ThreadSchedulerType ThreadSchedulerNew(const short *weight);
+void ThreadSchedulerDispose(ThreadSchedulerType scheduler);
+void ThreadSchedulerSet(ThreadType thread, ThreadSchedulerType scheduler);
+ThreadSchedulerType ThreadScheduler(ThreadType thread);
+ThreadTicksType ThreadSchedulerRun(ThreadSchedulerType scheduler, ThreadTicksType budget);
+void ThreadSchedulerStats(ThreadSchedulerType scheduler, ThreadSchedulerStatsType *stats);
+
+void ThreadMainCall(ThreadProcType proc, void *data, Boolean wait);
+short ThreadMainDrain(void);
 
 ThreadType ThreadBeginMain(ThreadProcType suspend,
 	ThreadProcType resume, void *data);
+ThreadType ThreadBeginMainOptions(ThreadProcType suspend,
+	ThreadProcType resume, void *data, ThreadOptionsType options);
 ThreadType ThreadBegin(ThreadProcType entry,
 	ThreadProcType suspend, ThreadProcType resume,
 	void *data, size_t stack_size);
+ThreadType ThreadBeginOptions(ThreadProcType entry,
+	ThreadProcType suspend, ThreadProcType resume,
+	void *data, size_t stack_size, ThreadOptionsType options);
+Boolean ThreadBeginBatch(ThreadProcType entry,
+	ThreadProcType suspend, ThreadProcType resume,
+	void **data, size_t stack_size, ThreadOptionsType options,
+	short count, ThreadType *threads);
 void ThreadEnd(ThreadType thread);
+
+/* THREAD_CHECK is a cheaper form of ThreadCheck for use in tight loops: the
+	function is only called once the active thread has used up its quantum.
+	The flag it tests is set at interrupt time and is private to Thread
+	Library. */
+extern volatile Boolean gThreadPreemptRequest;
+#define THREAD_CHECK()	((void) (gThreadPreemptRequest && (ThreadCheck(), 0)))
@@ -0,0 +1,275 @@
+/* See the file Distribution for distribution terms. */
+
+/*	ThreadLog lets threads write diagnostic messages to a file without
+	waiting for the disk. A message is copied into a buffer allocated when
+	the log is opened, and a thread of the log's own writes the buffer to
+	the file from time to time with ThreadIO, so no thread waits for the
+	File Manager except the log's. */
+
+/*----------------------------------------------------------------------------*/
+/* include statements */
+/*----------------------------------------------------------------------------*/
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <Files.h>
+#include <Memory.h>
+#include "ThreadLib.h"
+#include "ThreadIO.h"
+#include "ThreadLog.h"
+
+/*----------------------------------------------------------------------------*/
+/* declarations */
+/*----------------------------------------------------------------------------*/
+
+/* Define THREAD_LOG_INTERVAL as the number of ticks the log's thread sleeps
+	between writes. The thread is woken sooner if the buffer fills up. */
+#ifndef THREAD_LOG_INTERVAL
+	#define THREAD_LOG_INTERVAL	(THREAD_TICKS_SEC)
+#endif
+
+/* stack size for the log's thread */
+#define LOG_STACK						(4096)
+
+/* character ending each record */
+#define LOG_END						('\r')
+
+/* The buffer is used as a ring. Offsets into it only ever increase, and
+	are reduced modulo the buffer's size when it's accessed. Bytes before
+	'written' are free; bytes from 'written' to 'tail' are being written or
+	were discarded; bytes from 'tail' to 'head' are waiting to be written. */
+typedef struct {
+	Ptr buffer;										/* ring buffer */
+	long size;										/* size of buffer */
+	unsigned long head;							/* offset at which next record goes */
+	unsigned long tail;							/* offset of next byte to write */
+	unsigned long written;						/* offset of first byte in use */
+	short refNum;									/* file to write to */
+	ThreadLogPolicyType policy;				/* what to do when buffer is full */
+	ThreadType thread;							/* thread writing the buffer */
+	Boolean closing;								/* true when thread should end */
+	Boolean writing;								/* true while a write is being made */
+	OSErr error;									/* first error from a write */
+	ThreadIORec io;								/* write made by thread */
+	ThreadLogStatsType stats;					/* counters */
+} LogStateType;
+
+/* state of the log */
+static LogStateType gLog;
+
+/*----------------------------------------------------------------------------*/
+/* writing the buffer */
+/*----------------------------------------------------------------------------*/
+
+/* LogWrite writes the bytes waiting in the buffer to the file. Bytes that
+	wrap around the end of the buffer take a second write. */
+static void LogWrite(void)
+{
+	ThreadIOPtr io;
+	long start;
+	long count;
+	OSErr error;
+	
+	io = &gLog.io;
+	while (gLog.tail != gLog.head && ! gLog.error) {
+		start = gLog.tail % gLog.size;
+		count = gLog.head - gLog.tail;
+		if (count > gLog.size - start)
+			count = gLog.size - start;
+		gLog.tail += count;
+		gLog.writing = true;
+		memset(&io->pb, 0, sizeof(io->pb));
+		io->pb.ioParam.ioRefNum = gLog.refNum;
+		io->pb.ioParam.ioBuffer = gLog.buffer + start;
+		io->pb.ioParam.ioReqCount = count;
+		io->pb.ioParam.ioPosMode = fsAtMark;
+		error = ThreadIOWrite(io);
+		if (error)
+			gLog.error = error;
+		gLog.stats.writes++;
+		gLog.stats.bytes += io->pb.ioParam.ioActCount;
+		gLog.writing = false;
+		gLog.written = gLog.tail;
+	}
+}
+
+/* LogThread is the entry point of the log's thread. It sleeps for a while,
+	then writes whatever has been logged in the meantime, so that records
+	are written in large batches. It ends once the log is closing and
+	everything has been written. */
+static void LogThread(void *data)
+{
+	while (! gLog.closing) {
+		ThreadYield(THREAD_LOG_INTERVAL);
+		LogWrite();
+	}
+	LogWrite();
+	gLog.thread = THREAD_NONE;
+}
+
+/* LogWake wakes the log's thread so that it writes the buffer soon */
+static void LogWake(void)
+{
+	if (gLog.thread != THREAD_NONE)
+		ThreadSleepSet(gLog.thread, 0);
+}
+
+/* LogRoom returns the number of free bytes in the buffer */
+#define LogRoom()	(gLog.size - (long) (gLog.head - gLog.written))
+
+/* LogDropOldest discards the oldest record that isn't being written.
+	Returns false if there's no such record. */
+static Boolean LogDropOldest(void)
+{
+	Boolean dropped;
+	
+	dropped = false;
+	if (gLog.tail != gLog.head) {
+		while (gLog.tail != gLog.head && gLog.buffer[gLog.tail % gLog.size] != LOG_END)
+			gLog.tail++;
+		if (gLog.tail != gLog.head)
+			gLog.tail++;
+		if (! gLog.writing)
+			gLog.written = gLog.tail;
+		gLog.stats.dropped++;
+		dropped = true;
+	}
+	return(dropped);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Logging */
+/*----------------------------------------------------------------------------*/
+
+/*	�ThreadLogOpen opens the log, which is written to the already open file
+	'refNum' starting at the file's mark, and allocates a buffer of 'size'
+	bytes for it. The 'policy' parameter says what to do with a record when
+	the buffer is full. A thread is created to write the buffer to the file.
+	Returns noErr, or an error code if the log couldn't be opened. */
+OSErr ThreadLogOpen(short refNum, long size, ThreadLogPolicyType policy)
+{
+	OSErr error;
+	
+	error = noErr;
+	if (gLog.buffer || size <= 0)
+		error = paramErr;
+	else {
+		memset(&gLog, 0, sizeof(gLog));
+		gLog.buffer = NewPtr(size);
+		if (! gLog.buffer)
+			error = (MemError() ? MemError() : memFullErr);
+	}
+	if (! error) {
+		gLog.size = size;
+		gLog.refNum = refNum;
+		gLog.policy = policy;
+		gLog.thread = ThreadBegin(LogThread, NULL, NULL, NULL, LOG_STACK);
+		if (gLog.thread == THREAD_NONE) {
+			error = (ThreadError() ? ThreadError() : memFullErr);
+			DisposePtr(gLog.buffer);
+			gLog.buffer = NULL;
+		}
+	}
+	return(error);
+}
+
+/*	�ThreadLogClose writes everything in the log's buffer to the file, ends
+	the log's thread and disposes of the buffer. The file isn't closed.
+	Returns the first error from any write to the file. */
+OSErr ThreadLogClose(void)
+{
+	OSErr error;
+	
+	error = noErr;
+	if (gLog.buffer) {
+		gLog.closing = true;
+		while (gLog.thread != THREAD_NONE) {
+			LogWake();
+			ThreadYield(0);
+		}
+		error = gLog.error;
+		DisposePtr(gLog.buffer);
+		gLog.buffer = NULL;
+	}
+	return(error);
+}
+
+/*	�ThreadLogText adds a record containing the 'length' bytes of 'text' to
+	the log. The record is copied into the buffer, followed by a carriage
+	return; no memory is allocated and the file isn't touched. If the
+	buffer is full then what happens depends on the policy the log was
+	opened with: the new record or the oldest records are discarded (and
+	counted), or the active thread waits for the log's thread to make room.
+	Once a write to the file has failed, records that don't fit are always
+	discarded. Records that are larger than the whole buffer are always discarded.
+	Nothing is done if the log isn't open. */
+void ThreadLogText(const char *text, long length)
+{
+	long needed;
+	long start;
+	long first;
+	Boolean fits;
+	
+	if (gLog.buffer) {
+		needed = length + 1;
+		fits = (needed <= gLog.size);
+		while (fits && LogRoom() < needed) {
+			if (gLog.policy == THREAD_LOG_DROP_OLD)
+				fits = LogDropOldest();
+			else if (gLog.policy == THREAD_LOG_WAIT && gLog.thread != THREAD_NONE &&
+						! gLog.error)
+			{
+				LogWake();
+				ThreadYield(0);
+			}
+			else
+				fits = false;
+		}
+		if (! fits)
+			gLog.stats.dropped++;
+		else {
+			start = gLog.head % gLog.size;
+			first = gLog.size - start;
+			if (first > length)
+				first = length;
+			BlockMoveData(text, gLog.buffer + start, first);
+			BlockMoveData(text + first, gLog.buffer, length - first);
+			gLog.buffer[(gLog.head + length) % gLog.size] = LOG_END;
+			gLog.head += needed;
+			gLog.stats.records++;
+			
+			/* don't let the buffer get more than half full before it's written */
+			if (LogRoom() < gLog.size / 2)
+				LogWake();
+		}
+	}
+}
+
+/*	�ThreadLog formats a record as with printf and adds it to the log with
+	ThreadLogText. Records longer than THREAD_LOG_RECORD - 1 characters are
+	truncated. */
+void ThreadLog(const char *format, ...)
+{
+	char record[THREAD_LOG_RECORD];
+	va_list args;
+	long length;
+	
+	if (gLog.buffer) {
+		va_start(args, format);
+		length = vsnprintf(record, sizeof(record), format, args);
+		va_end(args);
+		if (length > (long) sizeof(record) - 1)
+			length = sizeof(record) - 1;
+		if (length > 0)
+			ThreadLogText(record, length);
+	}
+}
+
+/*	�ThreadLogStats returns the log's counters: the number of records added
+	to the buffer and discarded, and the number of bytes and calls used to
+	write the buffer to the file. */
+void ThreadLogStats(ThreadLogStatsType *stats)
+{
+	*stats = gLog.stats;
+}
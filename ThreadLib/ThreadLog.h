@@ -0,0 +1,30 @@
+/* See the file Distribution for distribution terms. */
+
+#pragma once
+
+#include "ThreadLib.h"
+
+/* what ThreadLog does with a record when the log's buffer is full */
+typedef long ThreadLogPolicyType;
+enum {
+	THREAD_LOG_DROP_NEW,							/* discard the new record */
+	THREAD_LOG_DROP_OLD,							/* discard the oldest records not yet written */
+	THREAD_LOG_WAIT								/* wait until the record fits */
+};
+
+/* longest record, in bytes, that ThreadLog formats */
+#define THREAD_LOG_RECORD		(256)
+
+/* counters kept by the log, as returned by ThreadLogStats */
+typedef struct {
+	long records;									/* records added to the buffer */
+	long dropped;									/* records discarded */
+	long bytes;										/* bytes written to the file */
+	long writes;									/* File Manager calls made */
+} ThreadLogStatsType;
+
+OSErr ThreadLogOpen(short refNum, long size, ThreadLogPolicyType policy);
+OSErr ThreadLogClose(void);
+void ThreadLog(const char *format, ...);
+void ThreadLogText(const char *text, long length);
+void ThreadLogStats(ThreadLogStatsType *stats);
@@ -0,0 +1,384 @@
+/* See the file Distribution for distribution terms. */
+
+/*	ThreadStream streams files sequentially through threads. A reader keeps
+	several reads in progress ahead of the thread consuming the data, so
+	the thread rarely has to wait for the disk. A writer gathers small
+	writes into large ones aligned on multiples of the buffer size, and a
+	thread of its own writes them while the caller carries on. Both are
+	built on ThreadIO, so the disk is busy while other threads run. */
+
+/*----------------------------------------------------------------------------*/
+/* include statements */
+/*----------------------------------------------------------------------------*/
+
+#include <string.h>
+#include <Events.h>
+#include <Files.h>
+#include <Memory.h>
+#include "ThreadLib.h"
+#include "ThreadIO.h"
+#include "ThreadStream.h"
+
+/*----------------------------------------------------------------------------*/
+/* declarations */
+/*----------------------------------------------------------------------------*/
+
+/* Buffer sizes are rounded up to a multiple of the size of a disk block,
+	since the File Manager reads and writes whole blocks most efficiently. */
+#define STREAM_BLOCK					(512L)
+
+/* stack size for a writer's thread */
+#define WRITER_STACK					(4096)
+
+/* StreamBuffersNew allocates 'count' buffers of 'size' bytes. Returns
+	noErr, or an error code if any of the buffers couldn't be allocated,
+	in which case none are left allocated. */
+static OSErr StreamBuffersNew(Ptr *buffer, long size, short count)
+{
+	OSErr error;
+	short i;
+	
+	error = noErr;
+	for (i = 0; i < count && ! error; i++) {
+		buffer[i] = NewPtr(size);
+		if (! buffer[i])
+			error = (MemError() ? MemError() : memFullErr);
+	}
+	if (error) {
+		while (i-- > 0) {
+			if (buffer[i])
+				DisposePtr(buffer[i]);
+		}
+	}
+	return(error);
+}
+
+/* StreamBuffersDispose disposes of buffers allocated by StreamBuffersNew */
+static void StreamBuffersDispose(Ptr *buffer, short count)
+{
+	short i;
+	
+	for (i = 0; i < count; i++) {
+		DisposePtr(buffer[i]);
+		buffer[i] = NULL;
+	}
+}
+
+/* StreamStats copies a stream's counters, setting the elapsed time */
+static void StreamStats(const ThreadStreamStatsType *counters,
+	ThreadStreamStatsType *stats)
+{
+	*stats = *counters;
+	stats->ticks = TickCount() - counters->ticks;
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Reading */
+/*----------------------------------------------------------------------------*/
+
+/* ReaderStart starts reading the next part of the file into the buffer */
+static void ReaderStart(ThreadReaderPtr reader, short i)
+{
+	ThreadIOPtr io;
+	
+	io = &reader->io[i];
+	memset(&io->pb, 0, sizeof(io->pb));
+	io->pb.ioParam.ioRefNum = reader->refNum;
+	io->pb.ioParam.ioBuffer = reader->buffer[i];
+	io->pb.ioParam.ioReqCount = reader->size;
+	io->pb.ioParam.ioPosMode = fsFromStart;
+	io->pb.ioParam.ioPosOffset = reader->position;
+	reader->position += reader->size;
+	reader->pending[i] = true;
+	reader->stats.calls++;
+	ThreadIOStart(io);
+	(void) PBReadAsync(&io->pb);
+}
+
+/*	�ThreadReaderOpen opens a reader on a file that's already open, starting
+	at the file's current mark, and starts filling 'count' buffers of 'size'
+	bytes (at most THREAD_STREAM_BUFFERS). Reads are started by, and wake,
+	the thread that calls ThreadReaderOpen and ThreadReaderRead, so only
+	that thread should read from the reader. Returns noErr, or an error
+	code if the reader couldn't be opened. */
+OSErr ThreadReaderOpen(ThreadReaderPtr reader, short refNum, long size, short count)
+{
+	OSErr error;
+	long mark;
+	short i;
+	
+	memset(reader, 0, sizeof(*reader));
+	error = noErr;
+	if (size <= 0 || count <= 0 || THREAD_STREAM_BUFFERS < count)
+		error = paramErr;
+	if (! error)
+		error = GetFPos(refNum, &mark);
+	if (! error) {
+		reader->size = (size + STREAM_BLOCK - 1) & ~(STREAM_BLOCK - 1);
+		reader->count = count;
+		error = StreamBuffersNew(reader->buffer, reader->size, count);
+	}
+	if (! error) {
+		reader->refNum = refNum;
+		reader->position = mark;
+		reader->stats.ticks = TickCount();
+		for (i = 0; i < count; i++)
+			ReaderStart(reader, i);
+	}
+	return(error);
+}
+
+/*	�ThreadReaderRead reads the next '*count' bytes from the file into 'data',
+	and sets '*count' to the number of bytes read. If the thread gets ahead
+	of the disk it sleeps until the next buffer has been filled. As with
+	FSRead, eofErr is returned if the end of the file was reached before
+	all the bytes were read. */
+OSErr ThreadReaderRead(ThreadReaderPtr reader, void *data, long *count)
+{
+	ThreadIOPtr io;
+	OSErr error;
+	long wanted;
+	long avail;
+	short i;
+	
+	error = noErr;
+	wanted = *count;
+	*count = 0;
+	while (wanted > 0 && ! error) {
+		i = reader->head;
+		io = &reader->io[i];
+		if (reader->pending[i]) {
+			if (! io->done)
+				reader->stats.stalls++;
+			(void) ThreadIOWait(io);
+			reader->pending[i] = false;
+			if (io->pb.ioParam.ioResult == eofErr)
+				reader->eof = true;
+		}
+		if (io->pb.ioParam.ioResult && io->pb.ioParam.ioResult != eofErr)
+			error = io->pb.ioParam.ioResult;
+		else {
+			avail = io->pb.ioParam.ioActCount - reader->offset;
+			if (avail > wanted)
+				avail = wanted;
+			BlockMoveData(reader->buffer[i] + reader->offset, (Ptr) data + *count, avail);
+			reader->offset += avail;
+			*count += avail;
+			wanted -= avail;
+			if (reader->offset == io->pb.ioParam.ioActCount) {
+				if (reader->eof)
+					error = (wanted > 0 ? eofErr : noErr);
+				else {
+					/* buffer is used up, so refill it and move on to the next */
+					ReaderStart(reader, i);
+					reader->head = (i + 1) % reader->count;
+					reader->offset = 0;
+				}
+			}
+		}
+	}
+	reader->stats.bytes += *count;
+	return(error);
+}
+
+/*	�ThreadReaderClose waits for any reads that are still in progress and
+	then disposes of the reader's buffers. The file isn't closed, and its
+	mark is left wherever the last read left it. */
+void ThreadReaderClose(ThreadReaderPtr reader)
+{
+	short i;
+	
+	for (i = 0; i < reader->count; i++) {
+		if (reader->pending[i]) {
+			(void) ThreadIOWait(&reader->io[i]);
+			reader->pending[i] = false;
+		}
+	}
+	StreamBuffersDispose(reader->buffer, reader->count);
+}
+
+/*	�ThreadReaderStats returns the reader's counters: the number of bytes
+	returned by ThreadReaderRead, the number of reads made, and the number
+	of times ThreadReaderRead had to wait for a read to finish. */
+void ThreadReaderStats(ThreadReaderPtr reader, ThreadStreamStatsType *stats)
+{
+	StreamStats(&reader->stats, stats);
+}
+
+/*----------------------------------------------------------------------------*/
+/*	�Writing */
+/*----------------------------------------------------------------------------*/
+
+/* WriterWait suspends the active thread until the writer's thread has
+	written a buffer */
+static void WriterWait(ThreadWriterPtr writer)
+{
+	writer->waiting = ThreadActive();
+	ThreadYield(THREAD_TICKS_MAX);
+}
+
+/* WriterWake wakes up a thread waiting in WriterWait, if there is one */
+static void WriterWake(ThreadWriterPtr writer)
+{
+	if (writer->waiting != THREAD_NONE) {
+		ThreadSleepSet(writer->waiting, 0);
+		writer->waiting = THREAD_NONE;
+	}
+}
+
+/* WriterQueue hands the buffer being filled to the writer's thread; the
+	next buffer filled starts where this one ends */
+static void WriterQueue(ThreadWriterPtr writer)
+{
+	short i;
+	
+	i = (writer->next + writer->queued) % writer->count;
+	writer->position += writer->used[i];
+	writer->queued++;
+	ThreadSleepSet(writer->writer, 0);
+}
+
+/* WriterThread is the entry point of a writer's thread. It writes buffers
+	as they're queued, and ends once the writer is closing and every buffer
+	has been written. */
+static void WriterThread(void *data)
+{
+	ThreadWriterPtr writer = data;
+	ThreadIOPtr io;
+	OSErr error;
+	short i;
+	
+	io = &writer->io;
+	while (writer->queued || ! writer->closing) {
+		if (! writer->queued)
+			ThreadYield(THREAD_TICKS_MAX);
+		else {
+			i = writer->next;
+			memset(&io->pb, 0, sizeof(io->pb));
+			io->pb.ioParam.ioRefNum = writer->refNum;
+			io->pb.ioParam.ioBuffer = writer->buffer[i];
+			io->pb.ioParam.ioReqCount = writer->used[i];
+			io->pb.ioParam.ioPosMode = fsFromStart;
+			io->pb.ioParam.ioPosOffset = writer->start[i];
+			writer->stats.calls++;
+			error = ThreadIOWrite(io);
+			if (error && ! writer->error)
+				writer->error = error;
+			writer->used[i] = 0;
+			writer->next = (i + 1) % writer->count;
+			writer->queued--;
+			WriterWake(writer);
+		}
+	}
+	writer->writer = THREAD_NONE;
+	WriterWake(writer);
+}
+
+/*	�ThreadWriterOpen opens a writer on a file that's already open, starting
+	at the file's current mark, with 'count' buffers of 'size' bytes (at
+	most THREAD_STREAM_BUFFERS), and creates the thread that writes them.
+	Returns noErr, or an error code if the writer couldn't be opened. */
+OSErr ThreadWriterOpen(ThreadWriterPtr writer, short refNum, long size, short count)
+{
+	OSErr error;
+	long mark;
+	
+	memset(writer, 0, sizeof(*writer));
+	error = noErr;
+	if (size <= 0 || count <= 0 || THREAD_STREAM_BUFFERS < count)
+		error = paramErr;
+	if (! error)
+		error = GetFPos(refNum, &mark);
+	if (! error) {
+		writer->size = (size + STREAM_BLOCK - 1) & ~(STREAM_BLOCK - 1);
+		writer->count = count;
+		error = StreamBuffersNew(writer->buffer, writer->size, count);
+	}
+	if (! error) {
+		writer->refNum = refNum;
+		writer->position = mark;
+		writer->stats.ticks = TickCount();
+		writer->writer = ThreadBegin(WriterThread, NULL, NULL, writer, WRITER_STACK);
+		if (writer->writer == THREAD_NONE) {
+			error = (ThreadError() ? ThreadError() : memFullErr);
+			StreamBuffersDispose(writer->buffer, count);
+		}
+	}
+	return(error);
+}
+
+/*	�ThreadWriterWrite copies 'count' bytes from 'data' to the writer's
+	buffers. Only one thread should write to the writer. Each buffer is
+	written once it's full; buffers end at file
+	offsets that are multiples of the buffer size, so that after the first
+	one every write is the size of a buffer and is aligned on it. The
+	active thread only waits if every buffer is waiting to be written.
+	Returns the first error from any write made since the writer was
+	opened. */
+OSErr ThreadWriterWrite(ThreadWriterPtr writer, const void *data, long count)
+{
+	long room;
+	long n;
+	short i;
+	
+	while (count > 0 && ! writer->error) {
+		if (writer->queued == writer->count) {
+			writer->stats.stalls++;
+			while (writer->queued == writer->count)
+				WriterWait(writer);
+		}
+		i = (writer->next + writer->queued) % writer->count;
+		if (! writer->used[i])
+			writer->start[i] = writer->position;
+		room = writer->size - (writer->start[i] % writer->size) - writer->used[i];
+		n = (count < room ? count : room);
+		BlockMoveData(data, writer->buffer[i] + writer->used[i], n);
+		writer->used[i] += n;
+		writer->stats.bytes += n;
+		data = (const char *) data + n;
+		count -= n;
+		if (n == room)
+			WriterQueue(writer);
+	}
+	return(writer->error);
+}
+
+/*	�ThreadWriterFlush writes any data left in the writer's buffers, and
+	waits until everything written to the writer is on its way to the disk.
+	Returns the first error from any write. */
+OSErr ThreadWriterFlush(ThreadWriterPtr writer)
+{
+	short i;
+	
+	i = (writer->next + writer->queued) % writer->count;
+	if (writer->used[i] && writer->queued < writer->count)
+		WriterQueue(writer);
+	while (writer->queued)
+		WriterWait(writer);
+	return(writer->error);
+}
+
+/*	�ThreadWriterClose flushes the writer, ends its thread, and disposes of
+	its buffers. The file isn't closed. Returns the first error from any
+	write. */
+OSErr ThreadWriterClose(ThreadWriterPtr writer)
+{
+	OSErr error;
+	
+	error = ThreadWriterFlush(writer);
+	writer->closing = true;
+	while (writer->writer != THREAD_NONE) {
+		ThreadSleepSet(writer->writer, 0);
+		WriterWait(writer);
+	}
+	StreamBuffersDispose(writer->buffer, writer->count);
+	return(error);
+}
+
+/*	�ThreadWriterStats returns the writer's counters: the number of bytes
+	passed to ThreadWriterWrite, the number of writes made, and the number
+	of times ThreadWriterWrite had to wait for a buffer. */
+void ThreadWriterStats(ThreadWriterPtr writer, ThreadStreamStatsType *stats)
+{
+	StreamStats(&writer->stats, stats);
+}
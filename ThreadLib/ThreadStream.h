@@ -0,0 +1,68 @@
+/* See the file Distribution for distribution terms. */
+
+#pragma once
+
+#include "ThreadIO.h"
+
+/* largest number of buffers a reader or writer can have */
+#define THREAD_STREAM_BUFFERS	(8)
+
+/* counters kept by a reader or writer, as returned by ThreadReaderStats and
+	ThreadWriterStats; the throughput in bytes per second is
+	bytes * THREAD_TICKS_SEC / ticks */
+typedef struct {
+	long bytes;										/* bytes read or written by caller */
+	long calls;										/* File Manager calls made */
+	long stalls;									/* times caller waited for the disk */
+	ThreadTicksType ticks;						/* ticks since opened */
+} ThreadStreamStatsType;
+
+/* Sequential reader that keeps all of its buffers being filled ahead of
+	the thread reading from it. The record must remain valid while the
+	reader is open, and mustn't be a local variable of a copy-stack thread
+	(see ThreadIORec). */
+typedef struct {
+	short refNum;									/* file being read */
+	long position;									/* file offset of next read to start */
+	long size;										/* size of each buffer */
+	short count;									/* number of buffers */
+	short head;										/* buffer being consumed */
+	long offset;									/* bytes consumed from head buffer */
+	Boolean pending[THREAD_STREAM_BUFFERS];/* true while buffer's read is unfinished */
+	Boolean eof;									/* true once end of file was read */
+	Ptr buffer[THREAD_STREAM_BUFFERS];		/* buffers */
+	ThreadIORec io[THREAD_STREAM_BUFFERS];	/* read of each buffer */
+	ThreadStreamStatsType stats;				/* counters */
+} ThreadReaderRec, *ThreadReaderPtr;
+
+/* Write-behind writer that collects writes in its buffers and has a thread
+	of its own write each buffer once it's full. The same restrictions
+	apply to the record as for a reader. */
+typedef struct {
+	short refNum;									/* file being written */
+	long position;									/* file offset of buffer being filled */
+	long size;										/* size of each buffer */
+	short count;									/* number of buffers */
+	short next;										/* next buffer to be written */
+	short queued;									/* buffers waiting to be written */
+	long used[THREAD_STREAM_BUFFERS];		/* bytes in each buffer */
+	long start[THREAD_STREAM_BUFFERS];		/* file offset of each buffer */
+	Ptr buffer[THREAD_STREAM_BUFFERS];		/* buffers */
+	ThreadIORec io;								/* write made by writer thread */
+	ThreadType writer;							/* thread writing buffers */
+	ThreadType waiting;							/* thread waiting for a buffer */
+	Boolean closing;								/* true when writer thread should end */
+	OSErr error;									/* first error from a write */
+	ThreadStreamStatsType stats;				/* counters */
+} ThreadWriterRec, *ThreadWriterPtr;
+
+OSErr ThreadReaderOpen(ThreadReaderPtr reader, short refNum, long size, short count);
+OSErr ThreadReaderRead(ThreadReaderPtr reader, void *data, long *count);
+void ThreadReaderClose(ThreadReaderPtr reader);
+void ThreadReaderStats(ThreadReaderPtr reader, ThreadStreamStatsType *stats);
+
+OSErr ThreadWriterOpen(ThreadWriterPtr writer, short refNum, long size, short count);
+OSErr ThreadWriterWrite(ThreadWriterPtr writer, const void *data, long count);
+OSErr ThreadWriterFlush(ThreadWriterPtr writer);
+OSErr ThreadWriterClose(ThreadWriterPtr writer);
+void ThreadWriterStats(ThreadWriterPtr writer, ThreadStreamStatsType *stats);
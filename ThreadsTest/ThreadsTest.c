@@ -365,19 +365,40 @@ static pascal void *tm_thread2(void *param)
 	return(NULL);
 }
 
+/* Display the counters in the dialog. Called by the main thread. */
+static void ShowCounts(void *data)
+{
+	if (gDialog) {
+		SetDNum(gDialog, iCount1, count1);
+		SetDNum(gDialog, iCount2, count2);
+	}
+}
+
+/* Display the time thread3 slept for in the dialog. Called by the main
+	thread. */
+static void ShowElapsed(void *data)
+{
+	if (gDialog)
+		SetDNum(gDialog, iElapsed, (long) data);
+}
+
 /* Thread to update display of the counters in the dialog. By passing a
 	non-zero value to ThreadYield we can effectively get a thread that is
 	executed periodically. For this simple test application we get the
 	dialog from a global variable, but you could use the 'data' parameter
-	to pass any application specific information to the thread. */
+	to pass any application specific information to the thread. With Thread
+	Library the dialog is drawn by the main thread, using ThreadMainCall,
+	since drawing is only safe from the main thread. */
 static void thread3(void *data)
 {
 	ThreadTicksType ticks;
 	
 	for (;;) {
 		if (gDialog) {
-			SetDNum(gDialog, iCount1, count1);
-			SetDNum(gDialog, iCount2, count2);
+			if (gUseThreadManager)
+				ShowCounts(NULL);
+			else
+				ThreadMainCall(ShowCounts, NULL, true);
 			ticks = TickCount();
 			/* run this thread once every second */
 			if (gUseThreadManager) {
@@ -387,8 +408,10 @@ static void thread3(void *data)
 			}
 			else
 				ThreadYield(THREAD_TICKS_SEC);
-			if (gDialog)
-				SetDNum(gDialog, iElapsed, TickCount() - ticks);
+			if (gUseThreadManager)
+				ShowElapsed((void *) (TickCount() - ticks));
+			else
+				ThreadMainCall(ShowElapsed, (void *) (TickCount() - ticks), false);
 		}
 	}
 }
@@ -568,8 +591,11 @@ static Boolean GetAndDoEvent(void)
 	SetCursor(&qd.arrow);
 	if (gUseThreadManager)
 		(void) EventGet(everyEvent, &event, 0, NULL);
-	else
+	else {
+		/* make the calls threads have asked the main thread to make */
+		(void) ThreadMainDrain();
 		(void) EventGet(everyEvent, &event, ThreadYieldInterval(), NULL);
+	}
 	return(DoEvent(&event));
 }
 
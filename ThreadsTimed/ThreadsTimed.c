@@ -36,6 +36,46 @@
 	in the program. It is still better, however, to have a faster context
 	switch time.
 	
+	The Thread Library test is run twice: first with every thread on a stack
+	of its own, and then with the threads created with THREAD_OPTION_COPY_STACK
+	so that they share a single stack. In the second test the used part of a
+	thread's stack is copied off and back onto the shared stack around every
+	context switch, so comparing the two counts shows the cost of the copying
+	that buys the smaller memory footprint.
+	
+	The Makefile target threadstimed-optimized builds this program and
+	Thread Library with -O2; the program says whether it was optimized, so
+	the results of the two builds can be put side by side.
+	
+	Likewise, the targets threadstimed-nodebug and threadstimed-fulldebug
+	build it with Thread Library's debug code disabled and with its full
+	validation of threads and queues (THREAD_DEBUG defined as 2), so the cost
+	of the debug checks made on every context switch can be measured against
+	the default build.
+	
+	Each test also reports the number of yields per second, which is the
+	most direct measure of the cost of a context switch, and, from the
+	counters returned by ThreadStats, the number of context switches and
+	the longest time a thread waited past its wake time. When compiled
+	with GCC, Thread Library switches contexts with a few instructions that
+	save and load only the registers a C function must preserve; compiling
+	Thread Library with THREAD_ASM_SWITCH defined as 0 makes it use setjmp
+	and longjmp instead, so the two figures can be compared.
+	
+	On a machine with an FPU the Thread Library test is run once more with
+	the threads created with THREAD_OPTION_FPU. None of the threads actually
+	does any floating point arithmetic, but since they all claim to use the
+	FPU its registers are saved and restored on every switch between them,
+	so this is the worst case. Threads that don't use the FPU pay nothing
+	extra, which is what the first test shows.
+	
+	Two shorter tests compare the ways a thread can find state of its own.
+	In the first, each thread gets its data with ThreadData(ThreadActive()),
+	which searches the queue of threads; in the second, it uses a
+	thread-local storage key with ThreadKeyGet, which doesn't search. Each
+	thread does a batch of lookups every time it runs, and the number of
+	lookups per second is reported.
+	
 	The following output was produced on 94/03/01 on a Macintosh Plus running
 	System 7.0 and Thread Manager 1.2. All other extensions were disabled.
 	The only other open application was Finder 7.0. Thread Library 1.0d3
@@ -98,10 +138,16 @@
 #include <Threads.h>
 #include "ThreadLib.h"
 
-#define NTESTS		(3)		/* number of tests executed */
+#define NTESTS		(5)		/* number of tests executed */
 #define NTHREADS	(16)		/* number of threads to create */
 #define RUNSECS	(60L)		/* number of seconds to run each test */
 #define RUNTICKS	(RUNSECS * THREAD_TICKS_SEC)	/* time to run threads */
+#define KEYSECS	(10L)		/* number of seconds to run each storage test */
+#define KEYTICKS	(KEYSECS * THREAD_TICKS_SEC)	/* time to run storage tests */
+#define KEYLOOKUPS (100)	/* lookups made by a thread each time it runs */
+
+/* key used by the thread-local storage test */
+static ThreadKeyType gKey;
 
 /* data passed to threads */
 typedef struct {
@@ -158,6 +204,39 @@ static void tl_thread(void *data)
 	}
 }
 
+/* a thread that finds its data with ThreadData */
+static void data_thread(void *data)
+{
+	register ThreadDataType *td = data;
+	register short i;
+	
+	for (;;) {
+		for (i = 0; i < KEYLOOKUPS; i++) {
+			if (ThreadData(ThreadActive()) == td)
+				td->count++;
+		}
+		td->yield++;
+		ThreadYield(0);
+	}
+}
+
+/* a thread that finds its data with a thread-local storage key */
+static void key_thread(void *data)
+{
+	register ThreadDataType *td = data;
+	register short i;
+	
+	ThreadKeySet(gKey, td);
+	for (;;) {
+		for (i = 0; i < KEYLOOKUPS; i++) {
+			if (ThreadKeyGet(gKey) == td)
+				td->count++;
+		}
+		td->yield++;
+		ThreadYield(0);
+	}
+}
+
 /* a simple thread that uses Thread Manager */
 static pascal void *tm_thread(void *data)
 {
@@ -202,17 +281,20 @@ static long nt_thread(void)
 	return(count);
 }
 
-/* test ThreadLib */
-static void tl_test(void)
+/* test ThreadLib, creating the threads with the specified options */
+static void tl_test(ThreadOptionsType options, const char *name)
 {
 	ThreadType threads[NTHREADS];
 	ThreadDataType td;
 	EventRecord event;
 	ThreadTicksType nextEvent;
 	ThreadTicksType stop;
+	ThreadStatsType stats;
+	long checks;
 	short i;
 	
-	printf("\nTesting Thread Library. This will take %ld seconds.\n", RUNSECS);
+	printf("\nTesting Thread Library (%s). This will take %ld seconds.\n",
+		name, RUNSECS);
 
 	/* create main thread */
 	if (! ThreadBeginMain(NULL, NULL, NULL))
@@ -221,7 +303,7 @@ static void tl_test(void)
 	/* create several threads */
 	memset(&td, 0, sizeof(ThreadDataType));
 	for (i = 0; i < NTHREADS; i++) {
-		threads[i] = ThreadBegin(tl_thread, NULL, NULL, &td, 0);
+		threads[i] = ThreadBeginOptions(tl_thread, NULL, NULL, &td, 0, options);
 		if (! threads[i])
 			fatal("can't create thread using Thread Library", ThreadError());
 	}
@@ -244,12 +326,67 @@ static void tl_test(void)
 	}
 	
 	/* dispose of the threads */
+	ThreadStats(THREAD_NONE, &stats);
 	for (i = 0; i < NTHREADS; i++)
 		ThreadEnd(threads[i]);
+	checks = ThreadEventChecks();
 	ThreadEnd(ThreadMain());
 
-	printf("Thread Library: count = %ld (ThreadYield was called %ld times)\n",
-		td.count, td.yield);
+	printf("Thread Library (%s): count = %ld (ThreadYield was called %ld times)\n",
+		name, td.count, td.yield);
+	printf("Thread Library (%s): %ld yields per second\n", name, td.yield / RUNSECS);
+	printf("Thread Library (%s): EventAvail was called %ld times by the scheduler\n",
+		name, checks);
+	printf("Thread Library (%s): %ld context switches, longest wake delay %ld ticks\n",
+		name, stats.switches_in, stats.late_max);
+}
+
+/* test the cost of a thread finding its own data */
+static void key_test(ThreadProcType entry, const char *name)
+{
+	ThreadType threads[NTHREADS];
+	ThreadDataType td;
+	EventRecord event;
+	ThreadTicksType nextEvent;
+	ThreadTicksType stop;
+	short i;
+	
+	printf("\nTesting lookups with %s. This will take %ld seconds.\n",
+		name, KEYSECS);
+
+	/* create main thread, key, and several threads */
+	if (! ThreadBeginMain(NULL, NULL, NULL))
+		fatal("can't create main thread using Thread Library", ThreadError());
+	gKey = ThreadKeyNew(NULL);
+	if (gKey == THREAD_KEY_NONE)
+		fatal("can't allocate thread-local storage key", ThreadError());
+	memset(&td, 0, sizeof(ThreadDataType));
+	for (i = 0; i < NTHREADS; i++) {
+		threads[i] = ThreadBeginOptions(entry, NULL, NULL, &td, 0, THREAD_OPTION_NONE);
+		if (! threads[i])
+			fatal("can't create thread using Thread Library", ThreadError());
+	}
+	
+	/* run for a predetermined number of ticks */
+	nextEvent = 0;
+	stop = TickCount() + KEYTICKS;
+	while (TickCount() < stop) {
+		if (TickCount() >= nextEvent) {
+			while (GetNextEvent(everyEvent, &event))
+				;
+			nextEvent = TickCount() + THREAD_TICKS_SEC;
+		}
+		ThreadYield(0);
+	}
+	
+	/* dispose of the threads */
+	for (i = 0; i < NTHREADS; i++)
+		ThreadEnd(threads[i]);
+	ThreadKeyDispose(gKey);
+	ThreadEnd(ThreadMain());
+
+	printf("Lookups with %s: %ld lookups per second (%ld turns)\n",
+		name, td.count / KEYSECS, td.yield);
 }
 
 /* test Thread Manager */
@@ -296,6 +433,7 @@ static void tm_test(void)
 
 	printf("Thread Manager: count = %ld (YieldToAnyThread was called %ld times)\n",
 		td.count, td.yield);
+	printf("Thread Manager: %ld yields per second\n", td.yield / RUNSECS);
 }
 
 /* for comparison, test the same operation, but without using threads */
@@ -308,6 +446,7 @@ static void nt_test(void)
 void main(void)
 {
 	long threadsAttr;
+	long fpuType;
 	
 	HeapInit(0, 0);
 	ManagersInit();
@@ -318,10 +457,23 @@ void main(void)
 	printf("Apple's Thread Manager. Each test executes for a fixed number of\n");
 	printf("seconds. The larger the final count the more efficient the software.\n");
 	printf("For best results, don't do anything that could generate any events.\n");
-	printf("The entire program should take about %ld seconds to run.\n", RUNSECS * NTESTS);
+	printf("The entire program should take about %ld seconds to run.\n",
+		RUNSECS * NTESTS + KEYSECS * 2);
 	printf("This program needs about %ldK to run.\n",
 		(ThreadStackDefault() * NTHREADS + 131072L) / 1024);
-	tl_test();
+	#ifdef __OPTIMIZE__
+		printf("This program was compiled with optimization.\n");
+	#else
+		printf("This program was compiled without optimization.\n");
+	#endif
+	tl_test(THREAD_OPTION_NONE, "separate stacks");
+	tl_test(THREAD_OPTION_COPY_STACK, "copy stack");
+	if (Gestalt(gestaltFPUType, &fpuType) == noErr && fpuType != gestaltNoFPU)
+		tl_test(THREAD_OPTION_FPU, "FPU context");
+	else
+		printf("\nCan't test saving FPU context because there's no FPU.\n");
+	key_test(data_thread, "ThreadData");
+	key_test(key_thread, "ThreadKeyGet");
 	if (Gestalt(gestaltThreadMgrAttr, &threadsAttr) == noErr &&
 		 (threadsAttr & (1<<gestaltThreadMgrPresent)) != 0)
 	{